@@ -0,0 +1,358 @@
+// Microbenchmarks for the loaders, lookups, pricing and checkout on synthetic
+// datasets of 100 up to maxSize ingredients/menu items/users, and a stress
+// test of concurrent tills. Built as the cafe_bench target of CMakeLists.txt:
+//   cmake -S . -B build && cmake --build build --target cafe_bench
+//   ./build/cafe_bench --bench [maxSize] [results.csv]
+//   ./build/cafe_bench --stress [maxThreads]
+// Each benchmark runs in a scratch directory and reports ns/op and
+// allocations/op; results are also written as CSV.
+#define CAFE_BENCH
+#include "project.cpp"
+
+#pragma region Benchmarks
+// Calls to operator new so far; counted by bench_alloc.cpp
+size_t allocationsSoFar();
+
+static atomic<size_t> benchSink(0); // keeps measured results alive
+
+struct BenchResult {
+    string name;
+    size_t size;
+    size_t ops;
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+template <typename Body>
+BenchResult measure(const string& name, size_t size, size_t ops, Body body) {
+    size_t allocationsBefore = allocationsSoFar();
+    auto started = chrono::steady_clock::now();
+    body();
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+    size_t allocations = allocationsSoFar() - allocationsBefore;
+    return { name, size, ops, ns / ops, (double)allocations / ops };
+}
+
+// Writes inventory/menu/users files with `size` entries each; every menu
+// item uses 5 ingredients. menu_ingredients.txt is written separately so
+// its loader can be timed on its own.
+void writeBenchDataset(size_t size) {
+    ofstream inventory("inventory.txt");
+    for (size_t i = 0; i < size; i++) {
+        inventory << "ing" << i << ";" << 1 + i % 10 << ";" << 1e9 << ";kg\n";
+    }
+    inventory.close();
+
+    ofstream menu("menu.txt");
+    for (size_t i = 0; i < size; i++) {
+        menu << "item" << i << ";" << 5 + i % 7 << ";" << (i % 3 ? "Dish" : "Drink") << "\n";
+    }
+    menu.close();
+
+    ofstream users("users.txt");
+    for (size_t i = 0; i < size; i++) {
+        users << "user" << i << ";pass" << i << "\n";
+    }
+    users.close();
+
+    ofstream budget("budget.txt");
+    budget << 1e12 << "\n";
+    budget.close();
+}
+
+void writeBenchRecipes(size_t size) {
+    mt19937 random(42);
+    ofstream recipes("menu_ingredients.txt");
+    for (size_t i = 0; i < size; i++) {
+        recipes << "item" << i;
+        for (int j = 0; j < 5; j++) {
+            recipes << ";ing" << random() % size << ";" << 0.1 * (1 + j);
+        }
+        recipes << "\n";
+    }
+    recipes.close();
+}
+
+vector<BenchResult> runBenchmarks(size_t size) {
+    vector<BenchResult> results;
+    writeBenchDataset(size);
+
+    {
+        PersistenceQueue persistence;
+        Inventory inventory(&persistence);
+        results.push_back(measure("Inventory::loadFromFile", size, size, [&]() {
+            inventory.loadFromFile();
+            }));
+    }
+
+    Cafe cafe(0, chrono::milliseconds(0));
+    writeBenchRecipes(size);
+    results.push_back(measure("Cafe::loadMenuIngredients", size, size, [&]() {
+        cafe.loadMenuIngredients();
+        }));
+
+    vector<string> ingredientNames, itemNames;
+    for (size_t i = 0; i < size; i++) {
+        ingredientNames.push_back("ING" + to_string(i * 7919 % size));
+        itemNames.push_back("item" + to_string(i * 7919 % size));
+    }
+    Inventory* inventory = cafe.getInventory();
+    size_t found = 0;
+    results.push_back(measure("Inventory::findIngredient", size, size, [&]() {
+        for (const auto& name : ingredientNames) found += inventory->findIngredient(name) != nullptr;
+        }));
+    results.push_back(measure("Cafe::findMenuItem", size, size, [&]() {
+        for (const auto& name : itemNames) found += cafe.findMenuItem(name) != nullptr;
+        }));
+
+    double total = 0;
+    const auto& menu = cafe.getMenu();
+    results.push_back(measure("MenuItem::calculatePrice", size, menu.size(), [&]() {
+        for (const auto* item : menu) total += item->calculatePrice();
+        }));
+
+    Cart cart;
+    for (size_t i = 0; i < 40; i++) {
+        cart.addItem(menu[i * 7919 % menu.size()], 1 + i % 3);
+    }
+    const size_t recalculations = 20000;
+    results.push_back(measure("Cart::recalculateTotal(40 lines)", size, recalculations, [&]() {
+        for (size_t i = 0; i < recalculations; i++) cart.recalculateTotal();
+        }));
+    total += cart.getTotal();
+
+    User* user = cafe.login("user0", "pass0");
+    const size_t orders = size;
+    results.push_back(measure("Cafe::processOrder(3 lines)", size, orders, [&]() {
+        for (size_t i = 0; i < orders; i++) {
+            for (size_t j = 0; j < 3; j++) {
+                user->getCart()->addItem(menu[(i * 3 + j) * 7919 % menu.size()], 1);
+            }
+            cafe.processOrder(user);
+        }
+        }));
+
+    // Whole-menu repricing: a recipe walk per item against one recipe
+    // matrix product (built by the first call, outside the measurement)
+    cafe.repriceMenu();
+    results.push_back(measure("MenuItem::refreshPrice(whole menu)", size, menu.size(), [&]() {
+        for (auto* item : menu) item->refreshPrice();
+        }));
+    results.push_back(measure("Cafe::repriceMenu", size, menu.size(), [&]() {
+        found += cafe.repriceMenu();
+        }));
+
+    // Every edit rewrites menu.txt; the queued rewrites fold into a few
+    const size_t edits = min(size, (size_t)200);
+    results.push_back(measure("Cafe::saveMenuToFile", size, edits, [&]() {
+        for (size_t i = 0; i < edits; i++) {
+            cafe.setMenuItemBasePrice(menu[i * 7919 % menu.size()], 1.0 + i % 10);
+            cafe.saveMenuToFile();
+        }
+        cafe.flushPersistence();
+        }));
+
+    benchSink += found + (size_t)total;
+    return results;
+}
+
+// The repricing kernel alone on a menu-sized matrix: `items` rows of 5 to
+// 8 ingredients out of `ingredients`. One op is one whole-menu product.
+BenchResult benchRecipeMatrix(size_t items, size_t ingredients) {
+    mt19937 random(42);
+    RecipeMatrix matrix;
+    matrix.reserve(items, items * 8);
+    for (size_t i = 0; i < items; i++) {
+        matrix.addRow(5 + i % 7);
+        size_t entries = 5 + random() % 4;
+        for (size_t j = 0; j < entries; j++) {
+            matrix.addEntry((uint32_t)(random() % ingredients), 0.1 * (1 + j));
+        }
+    }
+    vector<double> prices(ingredients), itemPrices(items);
+    for (size_t i = 0; i < ingredients; i++) {
+        prices[i] = 1 + i % 10;
+    }
+
+    const size_t products = 50;
+    matrix.multiply(prices.data(), itemPrices.data());
+    BenchResult result = measure("RecipeMatrix::multiply(" + to_string(items / 1000) + "k x " +
+        to_string(ingredients / 1000) + "k)", items, products, [&]() {
+        for (size_t i = 0; i < products; i++) {
+            prices[i % ingredients] += 0.01;
+            matrix.multiply(prices.data(), itemPrices.data());
+        }
+        });
+    benchSink += (size_t)itemPrices[items / 2];
+    return result;
+}
+
+int runBenchmarkSuite(size_t maxSize, const string& csvPath) {
+    filesystem::path home = filesystem::current_path();
+    filesystem::path scratch = filesystem::temp_directory_path() / "cafe_bench";
+    vector<BenchResult> results;
+    auto report = [&](const BenchResult& result) {
+        cout << left << setw(36) << result.name << right << setw(9) << result.size
+            << fixed << setprecision(1) << setw(14) << result.nsPerOp << " ns/op"
+            << setprecision(2) << setw(10) << result.allocsPerOp << " allocs/op\n";
+        results.push_back(result);
+    };
+
+    for (size_t size = 100; size <= maxSize; size *= 10) {
+        filesystem::remove_all(scratch);
+        filesystem::create_directories(scratch);
+        filesystem::current_path(scratch);
+        for (const auto& result : runBenchmarks(size)) {
+            report(result);
+        }
+        filesystem::current_path(home);
+        cout << "\n";
+    }
+    filesystem::remove_all(scratch);
+
+    report(benchRecipeMatrix(100000, 20000));
+    cout << "\n";
+
+    ofstream csv(csvPath);
+    if (!csv.is_open()) {
+        throw string("Cannot open " + csvPath);
+    }
+    csv << "benchmark,size,ops,ns_per_op,allocs_per_op\n";
+    for (const auto& result : results) {
+        csv << result.name << "," << result.size << "," << result.ops << ","
+            << result.nsPerOp << "," << result.allocsPerOp << "\n";
+    }
+    csv.close();
+    cout << "Results written to " << csvPath << "\n";
+    return 0;
+}
+
+// Runs the same per-till workload on 1, 2, 4 ... maxThreads concurrent tills
+// against one Cafe and reports throughput and scaling against one till
+int runStressTest(unsigned maxThreads) {
+    const size_t size = 10000;
+    const size_t ordersPerTill = 200;
+    const size_t lookupsPerTill = 200000;
+
+    filesystem::path home = filesystem::current_path();
+    filesystem::path scratch = filesystem::temp_directory_path() / "cafe_stress";
+    filesystem::remove_all(scratch);
+    filesystem::create_directories(scratch);
+    filesystem::current_path(scratch);
+    writeBenchDataset(size);
+    writeBenchRecipes(size);
+
+    {
+        Cafe cafe(0, chrono::milliseconds(2));
+        cout << left << setw(10) << "tills" << right << setw(16) << "orders/s" << setw(10) << "speedup"
+            << setw(18) << "lookups/s" << setw(10) << "speedup" << "\n";
+
+        double baseOrders = 0, baseLookups = 0;
+        for (unsigned tills = 1; tills <= maxThreads; tills *= 2) {
+            atomic<size_t> failures(0);
+            auto runTills = [&](auto work) {
+                vector<thread> threads;
+                auto started = chrono::steady_clock::now();
+                for (unsigned t = 0; t < tills; t++) {
+                    threads.emplace_back(work, t);
+                }
+                for (auto& till : threads) till.join();
+                return chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            };
+
+            double orderSeconds = runTills([&](unsigned till) {
+                User* user = cafe.login("user" + to_string(till), "pass" + to_string(till));
+                for (size_t i = 0; i < ordersPerTill; i++) {
+                    try {
+                        for (size_t j = 0; j < 3; j++) {
+                            size_t item = (till * 7919 + i * 31 + j) % size;
+                            cafe.addToCart(user, cafe.findMenuItem("item" + to_string(item)), 1);
+                        }
+                        cafe.processOrder(user);
+                    }
+                    catch (const string&) {
+                        failures++;
+                    }
+                }
+                });
+
+            double lookupSeconds = runTills([&](unsigned till) {
+                double total = 0;
+                for (size_t i = 0; i < lookupsPerTill; i++) {
+                    MenuItem* item = cafe.findMenuItem("item" + to_string((till + i * 7919) % size));
+                    total += item->calculatePrice();
+                }
+                benchSink += (size_t)total;
+                });
+
+            double orders = tills * ordersPerTill / orderSeconds;
+            double lookups = tills * lookupsPerTill / lookupSeconds;
+            if (tills == 1) {
+                baseOrders = orders;
+                baseLookups = lookups;
+            }
+            cout << left << setw(10) << tills << right << fixed << setprecision(0)
+                << setw(16) << orders << setprecision(2) << setw(9) << orders / baseOrders << "x"
+                << setprecision(0) << setw(18) << lookups << setprecision(2) << setw(9) << lookups / baseLookups << "x";
+            if (failures > 0) cout << "  (" << failures << " failed orders)";
+            cout << "\n";
+        }
+
+        // Every till hammers one item whose ingredient runs out part way;
+        // the units sold must add up to exactly the stock that disappeared
+        const double hotStock = 1000;
+        cafe.getInventory()->addIngredient("hot", 1, hotStock, "unit");
+        cafe.addMenuItem("hot item", 1, false);
+        cafe.addMenuItemIngredient(cafe.findMenuItem("hot item"), cafe.getInventory()->findIngredient("hot"), 3);
+        atomic<size_t> sold(0);
+        vector<thread> threads;
+        for (unsigned till = 0; till < maxThreads; till++) {
+            threads.emplace_back([&, till]() {
+                User* user = cafe.login("user" + to_string(till), "pass" + to_string(till));
+                while (true) {
+                    try {
+                        cafe.addToCart(user, cafe.findMenuItem("hot item"), 2);
+                        cafe.processOrder(user);
+                        sold += 2;
+                    }
+                    catch (const string&) {
+                        user->getCart()->clear();
+                        break;
+                    }
+                }
+                });
+        }
+        for (auto& till : threads) till.join();
+
+        double remaining = cafe.getInventory()->findIngredient("hot")->getQuantity();
+        cout << "\nhot ingredient: " << sold << " sold, " << remaining << " left of " << hotStock
+            << (remaining >= 0 && remaining == hotStock - sold * 3 ? " (consistent)" : " (OVERSOLD)") << "\n";
+    }
+
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch);
+    return 0;
+}
+#pragma endregion
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+    try {
+        if (mode == "--bench") {
+            size_t maxSize = argc > 2 ? strtoull(argv[2], nullptr, 10) : 100000;
+            string csvPath = argc > 3 ? argv[3] : "bench_results.csv";
+            return runBenchmarkSuite(maxSize, csvPath);
+        }
+        if (mode == "--stress") {
+            unsigned maxThreads = argc > 2 ? (unsigned)atoi(argv[2]) : thread::hardware_concurrency();
+            return runStressTest(max(1u, maxThreads));
+        }
+    }
+    catch (const string& error) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    cout << "Usage: " << argv[0] << " --bench [maxSize] [results.csv]\n"
+        << "       " << argv[0] << " --stress [maxThreads]\n";
+    return 1;
+}
@@ -0,0 +1,23 @@
+// Replaces the global operator new/delete to count allocations for the
+// benchmarks. It is kept out of bench.cpp so the compiler cannot inline
+// these into the code being measured and see free() called on memory from
+// operator new. The array and sized forms forward to these by default.
+#include <atomic>
+#include <cstdlib>
+#include <new>
+using namespace std;
+
+static atomic<size_t> allocationCount(0);
+
+size_t allocationsSoFar() {
+    return allocationCount.load();
+}
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)) return memory;
+    throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
@@ -8,10 +8,46 @@
 #include <algorithm>
 #include <sstream>
 #include <chrono>
+#include <unordered_map>
+#include <cctype>
+#include <thread>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <climits>
+#include <map>
+#include <unordered_set>
+#include <atomic>
+#include <random>
+#include <cstdio>
+#include <new>
+#include <string_view>
+#include <charconv>
+#include <functional>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <cmath>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 using namespace std;
 
 class Ingredient;
 class Inventory;
+class Preparation;
 class MenuItem;
 class Dish;
 class Drink;
@@ -20,6 +56,8 @@ class Admin;
 class Cart;
 class Order;
 class Cafe;
+struct PriceUpdate;
+struct PriceImport;
 
 void adminMenu(Cafe& cafe);
 void userMenu(Cafe& cafe, User* user);
@@ -33,7 +71,11 @@ string getCurrentDateTime() {
     const auto now = chrono::system_clock::now();
     const auto nowAsTimeT = chrono::system_clock::to_time_t(now);
     struct tm buf;
+#ifdef _WIN32
     localtime_s(&buf, &nowAsTimeT);
+#else
+    localtime_r(&nowAsTimeT, &buf);
+#endif
     char str[100];
     strftime(str, sizeof(str), "%Y-%m-%d %H:%M", &buf);
     return str;
@@ -43,478 +85,4062 @@ string lowerCase(string str) {
     transform(str.begin(), str.end(), str.begin(), ::tolower);
     return str;
 }
-#pragma endregion
 
-class Ingredient {
-    string name;
-    double quantity;
-    string unit;
-    double price;
-public:
-    Ingredient(string name, double price, double quantity, string unit) {
-        this->name = name;
-        this->price = price;
-        this->quantity = quantity;
-        this->unit = unit;
+bool equalsIgnoreCase(const string& a, const string& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
     }
+    return true;
+}
 
-    string getName() const { return name; }
-    string getUnit() const { return unit; }
-    double getPrice() const { return price; }
-    double getQuantity() const { return quantity; }
-
-    void setName(string name) { this->name = name; }
-    void setUnit(string unit) { this->unit = unit; }
-
-    void setQuantity(double quantity) {
-        if (quantity < 0) {
-            throw string("Quantity cannot be negative");
+// Hash/equality for containers keyed by names that compare case-insensitively,
+// so lookups don't need to build a lowercased copy of the key
+struct CaseInsensitiveHash {
+    size_t operator()(const string& str) const {
+        size_t hash = 14695981039346656037ull;
+        for (char c : str) {
+            hash ^= (size_t)tolower((unsigned char)c);
+            hash *= 1099511628211ull;
         }
-        this->quantity = quantity;
+        return hash;
     }
+};
 
-    void setPrice(double price) {
-        if (price < 0) {
-            throw string("Price cannot be negative");
-        }
-        this->price = price;
+struct CaseInsensitiveEqual {
+    bool operator()(const string& a, const string& b) const {
+        return equalsIgnoreCase(a, b);
     }
+};
 
-    bool decreaseQuantity(double amount) {
-        if (quantity >= amount) {
-            quantity -= amount;
-            return true;
+FILE* openFile(const string& path, const char* mode) {
+    FILE* file = nullptr;
+#ifdef _WIN32
+    fopen_s(&file, path.c_str(), mode);
+#else
+    file = fopen(path.c_str(), mode);
+#endif
+    return file;
+}
+
+// Days since 1970-01-01 for a "YYYY-MM-DD" date, using plain integer
+// arithmetic on the proleptic Gregorian calendar (no mktime/strftime)
+bool parseDayNumber(string_view date, int& day) {
+    if (date.size() < 10 || date[4] != '-' || date[7] != '-') return false;
+    for (int i : { 0, 1, 2, 3, 5, 6, 8, 9 }) {
+        if (!isdigit((unsigned char)date[i])) return false;
+    }
+    int y = (date[0] - '0') * 1000 + (date[1] - '0') * 100 + (date[2] - '0') * 10 + (date[3] - '0');
+    unsigned m = (date[5] - '0') * 10 + (date[6] - '0');
+    unsigned d = (date[8] - '0') * 10 + (date[9] - '0');
+    if (m < 1 || m > 12 || d < 1 || d > 31) return false;
+
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    day = era * 146097 + (int)doe - 719468;
+    return true;
+}
+
+string formatDayNumber(int day) {
+    day += 719468;
+    const int era = (day >= 0 ? day : day - 146096) / 146097;
+    const unsigned doe = (unsigned)(day - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    const unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    const unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    const int y = (int)yoe + era * 400 + (m <= 2);
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%04d-%02u-%02u", y, m, d);
+    return buffer;
+}
+
+// Flushes the stdio buffer and forces the data down to the disk
+bool syncFile(FILE* file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// 64-bit file positions, so logs past 2 GB work on Windows too
+bool seekFile(FILE* file, long long offset, int origin = SEEK_SET) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin) == 0;
+#else
+    return fseeko(file, (off_t)offset, origin) == 0;
+#endif
+}
+
+long long tellFile(FILE* file) {
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return (long long)ftello(file);
+#endif
+}
+#pragma endregion
+
+#pragma region Record reader
+// Read-only view of a whole data file, mapped into memory so loaders parse
+// the bytes in place. A missing file is simply not open; an empty one is
+// open with size 0.
+class MappedFile {
+    const char* bytes;
+    size_t length;
+    bool opened;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+public:
+    explicit MappedFile(const string& path) : bytes(nullptr), length(0), opened(false) {
+#ifdef _WIN32
+        mapping = nullptr;
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size)) {
+            opened = true;
+            length = (size_t)size.QuadPart;
+            if (length > 0) {
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mapping) bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                if (!bytes) opened = false;
+            }
         }
-        return false;
+        CloseHandle(file);
+#else
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return;
+
+        struct stat info;
+        if (fstat(descriptor, &info) == 0) {
+            opened = true;
+            length = (size_t)info.st_size;
+            if (length > 0) {
+                void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                if (view != MAP_FAILED) {
+                    madvise(view, length, MADV_SEQUENTIAL);
+                    bytes = static_cast<const char*>(view);
+                }
+                else {
+                    opened = false;
+                }
+            }
+        }
+        close(descriptor);
+#endif
     }
 
-    void increaseQuantity(double amount) {
-        quantity += amount;
+    ~MappedFile() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+#else
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
     }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return opened ? length : 0; }
 };
 
-class Inventory {
-    vector<Ingredient*> ingredients;
+// Walks ';'-separated (or `separator`-separated) records of a mapped file
+// (or of text already in memory) without copying: fields are string_views into the buffer, numbers
+// are parsed with from_chars and a trailing '\r' is dropped. A field that
+// does not parse throws "file:line: ..."; forEach() reports such lines on
+// cerr and carries on with the next one.
+class RecordReader {
+    string name;
+    unique_ptr<MappedFile> file;
+    string_view buffer;
+    size_t position;
+    size_t recordEnd;
+    size_t line;
+    bool terminated;
+    char separator;
+    vector<string_view> fields;
+
+    void split(string_view record) {
+        fields.clear();
+        size_t start = 0;
+        while (true) {
+            size_t end = record.find(separator, start);
+            if (end == string_view::npos) {
+                fields.push_back(record.substr(start));
+                return;
+            }
+            fields.push_back(record.substr(start, end - start));
+            start = end + 1;
+        }
+    }
 public:
-    Inventory() {}
+    // Reads `path` from byte `startOffset` on
+    explicit RecordReader(const string& path, size_t startOffset = 0, char separator = ';')
+        : name(path), file(new MappedFile(path)), position(0), recordEnd(0), line(0), terminated(true),
+        separator(separator) {
+        buffer = string_view(file->data() ? file->data() : "", file->size());
+        position = recordEnd = min(startOffset, buffer.size());
+    }
 
-    ~Inventory() {
-        for (auto* ing : ingredients) {
-            delete ing;
+    RecordReader(string_view records, const string& name)
+        : name(name), buffer(records), position(0), recordEnd(0), line(0), terminated(true), separator(';') {}
+
+    bool isOpen() const { return !file || file->isOpen(); }
+    size_t size() const { return buffer.size(); }
+
+    // Moves to the next non-blank record; false at the end of the data
+    bool next() {
+        while (position < buffer.size()) {
+            size_t end = buffer.find('\n', position);
+            terminated = end != string_view::npos;
+            if (!terminated) end = buffer.size();
+
+            string_view record = buffer.substr(position, end - position);
+            if (!record.empty() && record.back() == '\r') record.remove_suffix(1);
+            position = recordEnd = terminated ? end + 1 : end;
+            line++;
+            if (record.empty()) continue;
+
+            split(record);
+            return true;
         }
+        return false;
     }
 
-    void addIngredient(string name, double price, double quantity, string unit) {
-        for (auto* ing : ingredients) {
-            if (lowerCase(ing->getName()) == lowerCase(name)) {
-                throw string("Ingredient already exists");
+    void forEach(const function<void()>& handle) {
+        while (next()) {
+            try {
+                handle();
+            }
+            catch (const string& e) {
+                cerr << e << "\n";
             }
         }
+    }
 
-        ingredients.push_back(new Ingredient(name, price, quantity, unit));
-        saveToFile();
+    // False for a last record that has no newline yet (a write in progress)
+    bool isTerminated() const { return terminated; }
+    // Byte offset just past the current record
+    size_t offset() const { return recordEnd; }
+    size_t lineNumber() const { return line; }
+    size_t fieldCount() const { return fields.size(); }
+
+    string error(const string& message) const {
+        return name + ":" + to_string(line) + ": " + message;
     }
 
-    void removeIngredient(const string& name) {
-        for (auto it = ingredients.begin(); it != ingredients.end(); ++it) {
-            if (lowerCase((*it)->getName()) == lowerCase(name)) {
-                delete* it;
-                ingredients.erase(it);
-                saveToFile();
-                return;
-            }
+    string_view field(size_t i) const {
+        if (i >= fields.size()) {
+            throw error("expected at least " + to_string(i + 1) + " fields");
         }
-        throw string("Ingredient not found");
+        return fields[i];
     }
 
-    Ingredient* findIngredient(const string& name) {
-        for (auto* ing : ingredients) {
-            if (lowerCase(ing->getName()) == lowerCase(name)) {
-                return ing;
-            }
+    string text(size_t i) const { return string(field(i)); }
+
+    double number(size_t i) const {
+        string_view value = field(i);
+        double result = 0;
+        auto parsed = from_chars(value.data(), value.data() + value.size(), result);
+        if (parsed.ec != errc() || parsed.ptr != value.data() + value.size()) {
+            throw error("'" + string(value) + "' is not a number");
         }
-        return nullptr;
+        return result;
     }
 
-    void updateIngredient(const string& name, double newQuantity, double newPrice) {
-        auto* ing = findIngredient(name);
-        if (!ing) {
-            throw string("Ingredient not found");
+    long long integer(size_t i) const {
+        string_view value = field(i);
+        long long result = 0;
+        auto parsed = from_chars(value.data(), value.data() + value.size(), result);
+        if (parsed.ec != errc() || parsed.ptr != value.data() + value.size()) {
+            throw error("'" + string(value) + "' is not a whole number");
         }
+        return result;
+    }
+};
+#pragma endregion
 
-        double oldCost = ing->getPrice() * ing->getQuantity();
-        double newCost = newPrice * newQuantity;
-        double costDiff = newCost - oldCost;
+#pragma region Binary snapshot
+// Flat little-or-no-parse encoding used by cafe.snap: numbers are stored as
+// raw host-order bytes and strings as a 32-bit length followed by the bytes
+class BinaryWriter {
+    string bytes;
+public:
+    template <typename T>
+    void put(T value) {
+        static_assert(is_arithmetic<T>::value, "BinaryWriter::put takes numbers");
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
 
-        ing->setQuantity(newQuantity);
-        ing->setPrice(newPrice);
-        saveToFile();
+    void putBytes(string_view value) {
+        bytes.append(value.data(), value.size());
     }
 
-    void loadFromFile() {
-        ifstream file("inventory.txt");
-        if (!file.is_open()) return;
+    void putString(const string& value) {
+        put<uint32_t>((uint32_t)value.size());
+        bytes += value;
+    }
 
-        string line;
-        while (getline(file, line)) {
-            if (line.empty()) continue;
+    const string& data() const { return bytes; }
+};
 
-            stringstream ss(line);
-            string name, unit, priceStr, qtyStr;
+class BinaryReader {
+    string_view bytes;
+    size_t position;
 
-            getline(ss, name, ';');
-            getline(ss, priceStr, ';');
-            getline(ss, qtyStr, ';');
-            getline(ss, unit, ';');
+    void require(size_t count) const {
+        if (bytes.size() - position < count) {
+            throw string("cafe.snap is truncated");
+        }
+    }
+public:
+    explicit BinaryReader(string_view bytes) : bytes(bytes), position(0) {}
+
+    template <typename T>
+    T get() {
+        static_assert(is_arithmetic<T>::value, "BinaryReader::get reads numbers");
+        require(sizeof(T));
+        T value;
+        memcpy(&value, bytes.data() + position, sizeof(T));
+        position += sizeof(T);
+        return value;
+    }
 
-            double price = stod(priceStr);
-            double quantity = stod(qtyStr);
+    string_view getBytes(size_t count) {
+        require(count);
+        string_view value = bytes.substr(position, count);
+        position += count;
+        return value;
+    }
 
-            ingredients.push_back(new Ingredient(name, price, quantity, unit));
-        }
-        file.close();
+    string getString() {
+        return string(getBytes(get<uint32_t>()));
+    }
+};
+
+uint32_t fnv1a(string_view bytes) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : bytes) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+#pragma endregion
+
+#pragma region Object pools
+// Arena for entities that live until shutdown (ingredients, menu items,
+// users, orders). Objects are packed into chunks that double in size and
+// never move, so a pointer into the pool is a stable handle. Creating an
+// object bumps an atomic counter instead of calling malloc, and the pool
+// frees every chunk in one pass when it is destroyed.
+template <typename T>
+class ObjectPool {
+    static const size_t FIRST_CHUNK = 64;
+    static const int MAX_CHUNKS = 40;
+
+    atomic<size_t> count;
+    atomic<unsigned char*> chunks[MAX_CHUNKS];
+
+    static size_t chunkSize(int chunk) { return FIRST_CHUNK << chunk; }
+
+    // Chunk k holds slots [FIRST_CHUNK * (2^k - 1), FIRST_CHUNK * (2^(k+1) - 1))
+    static int locate(size_t slot, size_t& offset) {
+        size_t blocks = slot / FIRST_CHUNK + 1;
+        int chunk = 0;
+        while (blocks >> (chunk + 1)) chunk++;
+        offset = slot - FIRST_CHUNK * ((size_t(1) << chunk) - 1);
+        return chunk;
     }
 
-    void saveToFile() {
-        ofstream file("inventory.txt");
-        if (!file.is_open()) {
-            throw string("Cannot open inventory file");
+    // Objects first, then one "constructed" flag per slot
+    unsigned char* chunkAt(int chunk) {
+        unsigned char* storage = chunks[chunk].load(memory_order_acquire);
+        if (storage) return storage;
+
+        size_t slots = chunkSize(chunk);
+        unsigned char* fresh = static_cast<unsigned char*>(::operator new(slots * (sizeof(T) + 1)));
+        fill_n(fresh + slots * sizeof(T), slots, (unsigned char)0);
+        if (chunks[chunk].compare_exchange_strong(storage, fresh, memory_order_acq_rel, memory_order_acquire)) {
+            return fresh;
         }
+        ::operator delete(fresh); // another thread installed it first
+        return storage;
+    }
+public:
+    ObjectPool() : count(0) {
+        static_assert(alignof(T) <= alignof(max_align_t), "ObjectPool needs the default new alignment");
+        for (auto& chunk : chunks) chunk.store(nullptr, memory_order_relaxed);
+    }
 
-        for (const auto* ing : ingredients) {
-            file << ing->getName() << ";"
-                << ing->getPrice() << ";"
-                << ing->getQuantity() << ";"
-                << ing->getUnit() << "\n";
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool() {
+        for (int chunk = 0; chunk < MAX_CHUNKS; chunk++) {
+            unsigned char* storage = chunks[chunk].load(memory_order_relaxed);
+            if (!storage) continue;
+
+            size_t slots = chunkSize(chunk);
+            const unsigned char* constructed = storage + slots * sizeof(T);
+            for (size_t i = 0; i < slots; i++) {
+                if (constructed[i]) reinterpret_cast<T*>(storage + i * sizeof(T))->~T();
+            }
+            ::operator delete(storage);
         }
-        file.close();
     }
 
-    const vector<Ingredient*>& getIngredients() const {
-        return ingredients;
+    template <typename... Args>
+    T* create(Args&&... args) {
+        size_t offset;
+        int chunk = locate(count.fetch_add(1, memory_order_relaxed), offset);
+        if (chunk >= MAX_CHUNKS) throw bad_alloc();
+
+        unsigned char* storage = chunkAt(chunk);
+        T* object = new (storage + offset * sizeof(T)) T(forward<Args>(args)...);
+        storage[chunkSize(chunk) * sizeof(T) + offset] = 1;
+        return object;
     }
-};
 
-class MenuItem {
-protected:
-    string name;
-    double basePrice;
-    vector<pair<Ingredient*, double>> ingredients;
+    size_t size() const { return count.load(memory_order_relaxed); }
+};
+#pragma endregion
 
+#pragma region Background persistence
+// Writes data files on one background thread, so a slow disk does not stall
+// a till that edits the menu, registers a user or compacts the inventory
+// log. A job carries the complete bytes to write, produced by the caller
+// under its own locks. A job for a file that already has one waiting is
+// folded into it: a newer replacement supersedes the waiting one and
+// appends are concatenated, so ten menu edits cost one write. The queue
+// holds at most CAPACITY jobs; submitters wait for room beyond that.
+// barrier() waits until everything submitted before it has been written.
+class PersistenceQueue {
 public:
-    MenuItem(string name, double basePrice) : name(name), basePrice(basePrice) {}
-    MenuItem(const MenuItem& other) {
-        this->name = other.name;
-        this->basePrice = other.basePrice;
-    }
-    MenuItem& operator=(const MenuItem& other) {
-        this->name = other.name;
-        this->basePrice = other.basePrice;
+    enum Mode { REPLACE, APPEND };
+    // Writes the job's data itself instead of the plain replace/append;
+    // returns false on failure
+    typedef function<bool(const string& data)> Writer;
+
+    struct Stats {
+        size_t written;
+        size_t coalesced;
+        size_t failed;
+        size_t depth;
+        size_t maxDepth;
+        double meanLatencyMs;
+        double p99LatencyMs;
+        double maxLatencyMs;
+    };
+
+    static const size_t CAPACITY = 64;
+
+private:
+    static const size_t LATENCY_SAMPLES = 1024;
+
+    struct Job {
+        string path;
+        Mode mode;
+        string data;
+        Writer writer;
+        chrono::steady_clock::time_point submitted; // of the oldest data folded in
+        uint64_t sequence; // of the oldest submission folded in
+    };
+
+    deque<Job> queue;
+    mutable mutex queueMutex;
+    condition_variable queueReady;   // the writer waits for jobs
+    condition_variable queueChanged; // submitters wait for room, barriers for progress
+    uint64_t submissions;
+    bool writing;
+    string writingPath;
+    uint64_t writingSequence;
+    string failure; // first failed write since the last barrier
+    bool stopping;
+
+    size_t written;
+    size_t coalesced;
+    size_t failed;
+    size_t maxDepth;
+    vector<double> latencies; // the last LATENCY_SAMPLES, in milliseconds
+    size_t nextLatency;
+    double totalLatency;
+    double maxLatency;
+    thread writer;
+
+    static bool replaceFile(const string& path, const string& data) {
+        FILE* file = openFile(path + ".tmp", "wb");
+        if (!file) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file);
+        fclose(file);
+        error_code ec;
+        if (ok) filesystem::rename(path + ".tmp", path, ec);
+        return ok && !ec;
     }
-    virtual ~MenuItem() {}
 
-    string getName() const { return name; }
-    double getBasePrice() const { return basePrice; }
-    void setBasePrice(double price) { basePrice = price; }
+    static bool appendFile(const string& path, const string& data) {
+        FILE* file = openFile(path, "ab");
+        if (!file) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file);
+        fclose(file);
+        return ok;
+    }
 
-    void addIngredient(Ingredient* ingredient, double quantity) {
-        ingredients.push_back({ ingredient, quantity });
+    bool waitingFor(uint64_t sequence) const {
+        if (writing && writingSequence <= sequence) return true;
+        for (const auto& job : queue) {
+            if (job.sequence <= sequence) return true;
+        }
+        return false;
     }
 
-    virtual double calculatePrice() const {
-        double total = basePrice;
-        for (const auto& pair : ingredients) {
-            Ingredient* ing = pair.first;
-            double qty = pair.second;
-            total += ing->getPrice() * qty;
+    void run() {
+        unique_lock<mutex> lock(queueMutex);
+        while (true) {
+            queueReady.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            Job job = move(queue.front());
+            queue.pop_front();
+            writing = true;
+            writingPath = job.path;
+            writingSequence = job.sequence;
+            queueChanged.notify_all();
+            lock.unlock();
+
+            bool ok = job.writer ? job.writer(job.data) :
+                job.mode == APPEND ? appendFile(job.path, job.data) : replaceFile(job.path, job.data);
+            double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - job.submitted).count();
+
+            lock.lock();
+            writing = false;
+            writingPath.clear();
+            if (ok) {
+                written++;
+            }
+            else {
+                failed++;
+                if (failure.empty()) failure = "Cannot write " + job.path;
+            }
+            if (latencies.size() < LATENCY_SAMPLES) {
+                latencies.push_back(latency);
+            }
+            else {
+                latencies[nextLatency] = latency;
+            }
+            nextLatency = (nextLatency + 1) % LATENCY_SAMPLES;
+            totalLatency += latency;
+            maxLatency = max(maxLatency, latency);
+            queueChanged.notify_all();
         }
-        return total;
     }
 
-    virtual string getType() const = 0;
+public:
+    PersistenceQueue()
+        : submissions(0), writing(false), writingSequence(0), stopping(false),
+        written(0), coalesced(0), failed(0), maxDepth(0), nextLatency(0), totalLatency(0), maxLatency(0) {
+        writer = thread(&PersistenceQueue::run, this);
+    }
 
-    const vector<pair<Ingredient*, double>>& getIngredients() const {
-        return ingredients;
+    // Writes everything still queued before returning
+    ~PersistenceQueue() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_one();
+        writer.join();
     }
 
-    bool updateIngredientQuantity(const string& ingName, double newQty) {
-        for (auto& pair : ingredients) {
-            if (lowerCase(pair.first->getName()) == lowerCase(ingName)) {
-                pair.second = newQty;
-                return true;
+    PersistenceQueue(const PersistenceQueue&) = delete;
+    PersistenceQueue& operator=(const PersistenceQueue&) = delete;
+
+    void submit(const string& path, string data, Mode mode = REPLACE, Writer write = nullptr) {
+        unique_lock<mutex> lock(queueMutex);
+        uint64_t sequence = ++submissions;
+        for (auto job = queue.rbegin(); job != queue.rend(); ++job) {
+            if (job->path != path) continue;
+            if (job->mode == mode) {
+                if (mode == APPEND) {
+                    job->data += data;
+                }
+                else {
+                    job->data = move(data);
+                }
+                job->writer = move(write);
+                coalesced++;
+                return;
             }
+            break;
         }
-        return false;
+
+        queueChanged.wait(lock, [this]() { return queue.size() < CAPACITY; });
+        queue.push_back({ path, mode, move(data), move(write), chrono::steady_clock::now(), sequence });
+        maxDepth = max(maxDepth, queue.size() + (writing ? 1 : 0));
+        queueReady.notify_one();
     }
 
-    void showMenuItemIngr() const {
-        cout << "\nIngredients are below:\n";
-        for (auto& ingr : ingredients) {
-            cout << ingr.first->getName() << " - " << ingr.second << "\n";
+    // Waits until everything submitted so far is on disk. Throws if a write
+    // failed since the last barrier; the data it carried is not retried.
+    void barrier() {
+        unique_lock<mutex> lock(queueMutex);
+        uint64_t sequence = submissions;
+        queueChanged.wait(lock, [&]() { return !waitingFor(sequence); });
+        if (!failure.empty()) {
+            string error;
+            error.swap(failure);
+            throw error;
         }
     }
 
-    /*MenuItem* createModifiedCopy() const {
-        MenuItem* copy = (getType() == "Drink") ?
-            static_cast<MenuItem*>(new Drink(name, basePrice)) :
-            static_cast<MenuItem*>(new Dish(name, basePrice));
+    // Waits until nothing for `path` is queued or being written
+    void drain(const string& path) {
+        unique_lock<mutex> lock(queueMutex);
+        queueChanged.wait(lock, [&]() {
+            if (writing && writingPath == path) return false;
+            for (const auto& job : queue) {
+                if (job.path == path) return false;
+            }
+            return true;
+        });
+    }
 
-        for (const auto& pair : ingredients) {
-            copy->addIngredient(pair.first, pair.second);
+    Stats getStats() const {
+        lock_guard<mutex> lock(queueMutex);
+        Stats stats = { written, coalesced, failed, queue.size() + (writing ? 1 : 0), maxDepth, 0, 0, maxLatency };
+        size_t samples = written + failed;
+        if (samples > 0) {
+            stats.meanLatencyMs = totalLatency / samples;
+            vector<double> sorted = latencies;
+            size_t rank = min(sorted.size() - 1, sorted.size() * 99 / 100);
+            nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+            stats.p99LatencyMs = sorted[rank];
         }
-        return copy;
-    }*/
+        return stats;
+    }
 };
+#pragma endregion
 
-class Dish : public MenuItem {
-public:
-    Dish(string name, double basePrice) : MenuItem(name, basePrice) {}
-    string getType() const override { return "Dish"; }
-};
+#pragma region Depletion forecast
+// Hours since the epoch on the wall clock, so rates saved at shutdown can
+// be carried on from where they were on the next start
+double clockHours() {
+    return chrono::duration<double, ratio<3600>>(chrono::system_clock::now().time_since_epoch()).count();
+}
 
-class Drink : public MenuItem {
+// Exponentially weighted consumption rate of one ingredient. The units used
+// and the hours observed both decay with TIME_CONSTANT_HOURS; recording a
+// use decays them to its own time and adds to them, so it is O(1) however
+// far apart orders are. Dividing by the decayed hours observed rather than
+// by the time constant keeps the rate from reading low just after a start.
+class ConsumptionRate {
 public:
-    Drink(string name, double basePrice) : MenuItem(name, basePrice) {}
-    string getType() const override { return "Drink"; }
+    static constexpr double TIME_CONSTANT_HOURS = 3.0;
+    // Less history than this gives no rate: one early order would otherwise
+    // look like a rush
+    static constexpr double MIN_OBSERVED_HOURS = 0.25;
+
+    struct State {
+        double used;
+        double observed;
+        double updatedAt;
+    };
+private:
+    mutable mutex rateMutex;
+    State state;
+
+    // The state decayed to `now`; the caller holds rateMutex
+    State at(double now) const {
+        double elapsed = max(0.0, now - state.updatedAt);
+        double decay = exp(-elapsed / TIME_CONSTANT_HOURS);
+        return { state.used * decay,
+            state.observed * decay + TIME_CONSTANT_HOURS * (1 - decay),
+            max(now, state.updatedAt) };
+    }
+public:
+    ConsumptionRate() : state{ 0, 0, clockHours() } {}
+
+    void record(double amount, double now) {
+        lock_guard<mutex> lock(rateMutex);
+        state = at(now);
+        state.used = max(0.0, state.used + amount);
+    }
+
+    // Units per hour, or 0 while there is too little history
+    double perHour(double now) const {
+        lock_guard<mutex> lock(rateMutex);
+        State current = at(now);
+        return current.observed < MIN_OBSERVED_HOURS ? 0 : current.used / current.observed;
+    }
+
+    // Hours until `quantity` is used up at the current rate; infinity when
+    // nothing is being used
+    double hoursUntil(double quantity, double now) const {
+        double rate = perHour(now);
+        return rate > 0 ? quantity / rate : numeric_limits<double>::infinity();
+    }
+
+    State getState() const {
+        lock_guard<mutex> lock(rateMutex);
+        return state;
+    }
+
+    void setState(const State& saved) {
+        lock_guard<mutex> lock(rateMutex);
+        state = saved;
+    }
 };
 
-class Order {
-    static int nextOrderId;
-    int orderId;
-    string username;
-    string datetime;
-    vector<pair<MenuItem*, int>> items;
-    vector<pair<string, vector<pair<string, double>>>> itemIngredients;
-    double totalAmount;
+struct StockForecast {
+    Ingredient* ingredient;
+    double quantity;
+    double perHour;
+    double hoursLeft;
+};
+#pragma endregion
 
+// Quantity and price are atomics so tills can read them without locking.
+// Checkout moves the quantity with compare-and-swap, so tills never block
+// each other even on the most popular ingredient; admin edits of the same
+// ingredient are serialized with lockForUpdate().
+class Ingredient {
+    string name;
+    atomic<double> quantity;
+    string unit;
+    atomic<double> price;
+    mutable mutex updateMutex;
+    // Menu items whose flat recipe uses this ingredient, the reverse of
+    // their recipes: items join and leave as their recipes are compiled and
+    // when they leave the menu. They cache their price and portions.
+    // Replaced whole under updateMutex and read without it, since every
+    // stock change walks it from the till taking the stock.
+    shared_ptr<const vector<MenuItem*>> dependents;
+    // Preparations whose flat recipe uses this ingredient; kept by
+    // Preparation::compile under the menu's writer lock
+    vector<Preparation*> preparationUsers;
+    ConsumptionRate consumption;
+
+    // Tells every dependent menu item that its portions need recounting
+    void noteStockChange() const;
 public:
-    Order(string username)
-        : orderId(++nextOrderId), username(username), datetime(getCurrentDateTime()), totalAmount(0) {}
+    Ingredient(string name, double price, double quantity, string unit)
+        : name(name), quantity(quantity), unit(unit), price(price), dependents(make_shared<vector<MenuItem*>>()) {}
 
-    void addItem(MenuItem* item, int quantity, const vector<pair<string, double>>& modifiedIngredients = {}) {
-        items.push_back({ item, quantity });
-        itemIngredients.push_back({ item->getName(), modifiedIngredients.empty() ?
-                                getOriginalIngredients(item) : modifiedIngredients });
-        totalAmount += item->calculatePrice() * quantity;
+    string getName() const { return name; }
+    string getUnit() const { return unit; }
+    double getPrice() const { return price.load(memory_order_relaxed); }
+    double getQuantity() const { return quantity.load(memory_order_acquire); }
+
+    void setName(string name) { this->name = name; }
+    void setUnit(string unit) { this->unit = unit; }
+
+    unique_lock<mutex> lockForUpdate() const { return unique_lock<mutex>(updateMutex); }
+
+    ConsumptionRate& getConsumption() { return consumption; }
+    const ConsumptionRate& getConsumption() const { return consumption; }
+
+    double getHoursUntilStockout() const {
+        return consumption.hoursUntil(getQuantity(), clockHours());
     }
 
-    vector<pair<string, double>> getOriginalIngredients(MenuItem* item) {
-        vector<pair<string, double>> ingredients;
-        for (const auto& pair : item->getIngredients()) {
-            ingredients.push_back({ pair.first->getName(), pair.second });
+    void setQuantity(double quantity) {
+        exchangeQuantity(quantity);
+    }
+
+    // Replaces the quantity and returns the one it replaced, so the caller
+    // can log the exact delta even while orders are taking stock out
+    double exchangeQuantity(double quantity) {
+        if (quantity < 0) {
+            throw string("Quantity cannot be negative");
         }
-        return ingredients;
+        double replaced = this->quantity.exchange(quantity, memory_order_acq_rel);
+        noteStockChange();
+        return replaced;
     }
 
-    double getTotalAmount() const { return totalAmount; }
-    int getOrderId() const { return orderId; }
-    const vector<pair<MenuItem*, int>>& getItems() const { return items; }
-    const vector<pair<string, vector<pair<string, double>>>>& getItemIngredients() const { return itemIngredients; }
+    // Re-prices every dependent menu item. The caller holds lockForUpdate(),
+    // or nothing else is running yet (loading).
+    void setPrice(double price);
 
-    void saveToFile() const {
-        ofstream file("orders.txt", ios::app);
-        if (!file.is_open()) {
-            throw string("Cannot open orders file");
+    // Sets the price without re-pricing anything, for bulk updates that
+    // re-price each affected item once afterwards
+    void storePrice(double price) {
+        this->price.store(price, memory_order_relaxed);
+    }
+
+    shared_ptr<const vector<MenuItem*>> getDependents() const {
+        return atomic_load(&dependents);
+    }
+
+    void addDependent(MenuItem* item) {
+        lock_guard<mutex> lock(updateMutex);
+        auto current = atomic_load(&dependents);
+        if (find(current->begin(), current->end(), item) == current->end()) {
+            auto updated = make_shared<vector<MenuItem*>>(*current);
+            updated->push_back(item);
+            atomic_store(&dependents, shared_ptr<const vector<MenuItem*>>(move(updated)));
         }
+    }
 
-        file << orderId << ";"
-            << username << ";"
-            << datetime << ";"
-            << totalAmount << "\n";
+    void removeDependent(MenuItem* item) {
+        lock_guard<mutex> lock(updateMutex);
+        auto current = atomic_load(&dependents);
+        if (find(current->begin(), current->end(), item) != current->end()) {
+            auto updated = make_shared<vector<MenuItem*>>(*current);
+            updated->erase(find(updated->begin(), updated->end(), item));
+            atomic_store(&dependents, shared_ptr<const vector<MenuItem*>>(move(updated)));
+        }
+    }
+
+    const vector<Preparation*>& getPreparationUsers() const { return preparationUsers; }
+
+    void addPreparationUser(Preparation* preparation) {
+        if (find(preparationUsers.begin(), preparationUsers.end(), preparation) == preparationUsers.end()) {
+            preparationUsers.push_back(preparation);
+        }
+    }
+
+    void removePreparationUser(Preparation* preparation) {
+        auto found = find(preparationUsers.begin(), preparationUsers.end(), preparation);
+        if (found != preparationUsers.end()) preparationUsers.erase(found);
+    }
+
+    // Takes `amount` out only if that leaves the quantity non-negative
+    bool decreaseQuantity(double amount) {
+        double current = getQuantity();
+        while (current >= amount) {
+            if (quantity.compare_exchange_weak(current, current - amount,
+                memory_order_acq_rel, memory_order_acquire)) {
+                noteStockChange();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void increaseQuantity(double amount) {
+        double current = getQuantity();
+        while (!quantity.compare_exchange_weak(current, current + amount,
+            memory_order_acq_rel, memory_order_acquire)) {
+        }
+        noteStockChange();
+    }
+};
+
+// inventory.txt is a snapshot; every change after it is appended to
+// inventory.log as one record and the log is folded back into the snapshot
+// on a background thread once it grows past LOG_COMPACT_THRESHOLD records.
+// Tills take stock concurrently, so quantity records are replayed as deltas
+// (the order they reach the log in need not match the order they happened
+// in), unclamped so they add up in any order, and a quantity that ends
+// below zero is clamped once after replay. The resulting quantity and
+// price are written for reading the log by hand; only a record that
+// changed the price (priceDelta != 0) sets it on replay, since a till's
+// record may carry a price read before a concurrent admin change.
+//   +;name;price;quantity;unit
+//   -;name
+//   ~;name;quantityDelta;priceDelta;quantity;price
+// A delta replayed twice counts twice, so replay is not idempotent; it
+// relies on the hand-off instead: a finished snapshot is renamed to
+// inventory.txt.new before the log it covers is deleted, so no record is
+// ever applied to a snapshot twice.
+// Lock order: catalogMutex -> ingredient update lock -> logMutex.
+class Inventory {
+    static const int LOG_COMPACT_THRESHOLD = 1000;
+
+    // Removed ingredients stay in the pool until shutdown because other
+    // tills may still hold pointers to them
+    ObjectPool<Ingredient> pool;
+    vector<Ingredient*> ingredients;
+    // lowercased name -> ingredient, kept in sync with the vector above
+    unordered_map<string, Ingredient*, CaseInsensitiveHash, CaseInsensitiveEqual> index;
+    mutable shared_mutex catalogMutex;
+
+    FILE* logFile;
+    mutex logMutex;
+    string pendingLog;
+    int loggedRecords;
+    PersistenceQueue* persistence;
+
+    void insertIngredient(Ingredient* ing) {
+        ingredients.push_back(ing);
+        index.emplace(lowerCase(ing->getName()), ing);
+    }
+
+    void eraseIngredient(Ingredient* ing) {
+        index.erase(ing->getName());
+        ingredients.erase(find(ingredients.begin(), ingredients.end(), ing));
+    }
+
+    Ingredient* lookup(const string& name) const {
+        auto found = index.find(name);
+        return found != index.end() ? found->second : nullptr;
+    }
+
+    void logMutation(const string& record) {
+        lock_guard<mutex> lock(logMutex);
+        pendingLog += record;
+        pendingLog += "\n";
+        loggedRecords++;
+    }
+
+    void logChange(const Ingredient* ing, double quantityDelta, double priceDelta) {
+        ostringstream record;
+        record << setprecision(10) << "~;" << ing->getName() << ";"
+            << quantityDelta << ";" << priceDelta << ";"
+            << ing->getQuantity() << ";" << ing->getPrice();
+        logMutation(record.str());
+    }
+
+    string serialize() const {
+        ostringstream out;
+        out << setprecision(10);
+        for (const auto* ing : ingredients) {
+            out << ing->getName() << ";"
+                << ing->getPrice() << ";"
+                << ing->getQuantity() << ";"
+                << ing->getUnit() << "\n";
+        }
+        return out.str();
+    }
+
+    // forecast.txt: name;used;observed;updatedAt per ingredient with history
+    string serializeForecast() const {
+        ostringstream out;
+        out << setprecision(17);
+        for (const auto* ing : ingredients) {
+            ConsumptionRate::State state = ing->getConsumption().getState();
+            if (state.used <= 0) continue;
+            out << ing->getName() << ";" << state.used << ";"
+                << state.observed << ";" << state.updatedAt << "\n";
+        }
+        return out.str();
+    }
+
+    void replayLog(const string& path) {
+        RecordReader reader(path);
+        reader.forEach([&]() {
+            // Every record is written with its newline; a tail without one
+            // is a write that a crash cut short
+            if (!reader.isTerminated()) return;
+
+            string_view op = reader.field(0);
+            string name = reader.text(1);
+            Ingredient* ing = lookup(name);
+            if (op == "+") {
+                double price = reader.number(2);
+                double quantity = reader.number(3);
+                if (ing) eraseIngredient(ing);
+                insertIngredient(pool.create(name, price, quantity, reader.text(4)));
+            }
+            else if (op == "-") {
+                if (ing) eraseIngredient(ing);
+            }
+            else if (op == "~") {
+                double quantityDelta = reader.number(2);
+                double priceDelta = reader.number(3);
+                if (ing) {
+                    ing->increaseQuantity(quantityDelta);
+                    if (priceDelta != 0) ing->setPrice(reader.number(5));
+                }
+            }
+            else {
+                throw reader.error("unknown inventory log record");
+            }
+            loggedRecords++;
+        });
+    }
+
+    void closeLog() {
+        if (logFile) {
+            fclose(logFile);
+            logFile = nullptr;
+        }
+    }
+
+    // Appends pendingLog to inventory.log, waiting for the disk when `sync`
+    // is set. A write that fails is cut back out of the file and its
+    // records stay pending for the next attempt. The caller holds logMutex.
+    bool writePendingLog(bool sync) {
+        if (!logFile) logFile = openFile("inventory.log", "ab");
+        if (!logFile) return false;
+
+        seekFile(logFile, 0, SEEK_END);
+        long long before = tellFile(logFile);
+        bool ok = fwrite(pendingLog.data(), 1, pendingLog.size(), logFile) == pendingLog.size() &&
+            (sync ? syncFile(logFile) : fflush(logFile) == 0);
+        if (!ok) {
+            closeLog();
+            error_code ec;
+            if (before >= 0) filesystem::resize_file("inventory.log", (uintmax_t)before, ec);
+            return false;
+        }
+        pendingLog.clear();
+        return true;
+    }
+
+    // Moves the live log to inventory.log.old. The caller holds catalogMutex
+    // exclusively and logMutex, so no order is between taking its stock and
+    // logging it, and the snapshot serialized next covers exactly the old log.
+    bool rotateLog() {
+        if (!pendingLog.empty() && !writePendingLog(true)) return false;
+        closeLog();
+
+        error_code ec;
+        if (filesystem::exists("inventory.log.old")) {
+            // An earlier compaction failed; the live log joins its records
+            ifstream live("inventory.log", ios::binary);
+            string records((istreambuf_iterator<char>(live)), istreambuf_iterator<char>());
+            live.close();
+
+            FILE* old = openFile("inventory.log.old", "ab");
+            if (!old) return false;
+            bool written = fwrite(records.data(), 1, records.size(), old) == records.size() && syncFile(old);
+            fclose(old);
+            if (!written) return false;
+            filesystem::remove("inventory.log", ec);
+        }
+        else if (filesystem::exists("inventory.log")) {
+            filesystem::rename("inventory.log", "inventory.log.old", ec);
+            if (ec) return false;
+        }
+        loggedRecords = 0;
+        return true;
+    }
+
+    // Makes `snapshot` the new inventory.txt and drops the log it covers
+    static bool writeSnapshot(const string& snapshot) {
+        FILE* file = openFile("inventory.txt.tmp", "wb");
+        if (!file) return false;
+        bool written = fwrite(snapshot.data(), 1, snapshot.size(), file) == snapshot.size() && syncFile(file);
+        fclose(file);
+        if (!written) return false;
+
+        error_code ec;
+        filesystem::rename("inventory.txt.tmp", "inventory.txt.new", ec);
+        if (ec) return false;
+        filesystem::remove("inventory.log.old", ec);
+        if (ec) return false;
+        filesystem::rename("inventory.txt.new", "inventory.txt", ec);
+        return !ec;
+    }
+
+    // Finishes a snapshot hand-off that a crash interrupted
+    static void recoverSnapshot() {
+        if (!filesystem::exists("inventory.txt.new")) return;
+        error_code ec;
+        filesystem::remove("inventory.log.old", ec);
+        filesystem::rename("inventory.txt.new", "inventory.txt", ec);
+    }
+
+    // Rotates the log and queues the snapshot it covers for the background
+    // writer. The previous snapshot must be on disk first: it removes
+    // inventory.log.old, which the rotation may be about to add to.
+    void compactLog() {
+        unique_lock<shared_mutex> catalog(catalogMutex);
+        lock_guard<mutex> lock(logMutex);
+        if (loggedRecords < LOG_COMPACT_THRESHOLD) return; // another till got here first
+
+        persistence->drain("inventory.txt");
+        if (!rotateLog()) return;
+        persistence->submit("inventory.txt", serialize(), PersistenceQueue::REPLACE, writeSnapshot);
+    }
+public:
+    explicit Inventory(PersistenceQueue* persistence) : logFile(nullptr), loggedRecords(0), persistence(persistence) {}
+
+    ~Inventory() {
+        if (loggedRecords > 0) {
+            try {
+                saveToFile();
+            }
+            catch (const string&) {
+                // the log still holds every change, it is replayed on next start
+            }
+        }
+    }
+
+    void addIngredient(string name, double price, double quantity, string unit) {
+        {
+            unique_lock<shared_mutex> catalog(catalogMutex);
+            if (index.count(name)) {
+                throw string("Ingredient already exists");
+            }
+
+            insertIngredient(pool.create(name, price, quantity, unit));
+            ostringstream record;
+            record << setprecision(10) << "+;" << name << ";" << price << ";" << quantity << ";" << unit;
+            logMutation(record.str());
+        }
+        commitLog();
+    }
+
+    void removeIngredient(const string& name) {
+        {
+            unique_lock<shared_mutex> catalog(catalogMutex);
+            Ingredient* ing = lookup(name);
+            if (!ing) {
+                throw string("Ingredient not found");
+            }
+
+            logMutation("-;" + ing->getName());
+            eraseIngredient(ing);
+        }
+        commitLog();
+    }
+
+    Ingredient* findIngredient(const string& name) const {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        return lookup(name);
+    }
+
+    void updateIngredient(const string& name, double newQuantity, double newPrice) {
+        {
+            shared_lock<shared_mutex> catalog(catalogMutex);
+            auto* ing = lookup(name);
+            if (!ing) {
+                throw string("Ingredient not found");
+            }
+
+            auto update = ing->lockForUpdate();
+            if (newQuantity < 0) {
+                throw string("Quantity cannot be negative");
+            }
+            double oldPrice = ing->getPrice();
+            ing->setPrice(newPrice);
+            double oldQuantity = ing->exchangeQuantity(newQuantity);
+            logChange(ing, newQuantity - oldQuantity, newPrice - oldPrice);
+        }
+        commitLog();
+    }
+
+    // Two-phase stock reservation for one order: every need is taken out
+    // with compare-and-swap and, if one falls short, the ones already taken
+    // are put back. Returns the ingredient that ran short, or nullptr once
+    // all of it is reserved, logged and counted into the consumption rates;
+    // the log reaches disk on commitLog().
+    Ingredient* reserveStock(const vector<pair<Ingredient*, double>>& needs) {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        for (size_t i = 0; i < needs.size(); i++) {
+            if (!needs[i].first->decreaseQuantity(needs[i].second)) {
+                for (size_t j = 0; j < i; j++) {
+                    needs[j].first->increaseQuantity(needs[j].second);
+                }
+                return needs[i].first;
+            }
+        }
+        double now = clockHours();
+        for (const auto& need : needs) {
+            logChange(need.first, -need.second, 0);
+            need.first->getConsumption().record(need.second, now);
+        }
+        return nullptr;
+    }
+
+    // Puts back stock that reserveStock took for an order that was not
+    // placed. The log gets the opposite deltas so a replay nets to zero;
+    // like reserveStock, it reaches disk on commitLog().
+    void releaseStock(const vector<pair<Ingredient*, double>>& needs) {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        double now = clockHours();
+        for (const auto& need : needs) {
+            need.first->increaseQuantity(need.second);
+            logChange(need.first, need.second, 0);
+            need.first->getConsumption().record(-need.second, now);
+        }
+    }
+
+    // Writes the pending records and waits for the disk. Checkout passes
+    // `sync` false: the order committer's syncLog makes its records durable
+    // with the rest of the batch.
+    void commitLog(bool sync = true) {
+        {
+            lock_guard<mutex> lock(logMutex);
+            if (pendingLog.empty()) return;
+
+            if (!writePendingLog(sync)) {
+                throw string("Cannot write inventory log");
+            }
+
+            if (loggedRecords < LOG_COMPACT_THRESHOLD) return;
+        }
+        compactLog();
+    }
+
+    // Makes every committed record durable; called by the order committer
+    bool syncLog() {
+        lock_guard<mutex> lock(logMutex);
+        return !logFile || syncFile(logFile);
+    }
+
+    void loadFromFile() {
+        unique_lock<shared_mutex> catalog(catalogMutex);
+        recoverSnapshot();
+        RecordReader reader("inventory.txt");
+        reader.forEach([&]() {
+            string name = reader.text(0);
+            double price = reader.number(1);
+            double quantity = reader.number(2);
+            string unit = reader.text(3);
+
+            if (index.count(name)) return;
+            insertIngredient(pool.create(name, price, quantity, unit));
+        });
+
+        replayLog("inventory.log.old");
+        replayLog("inventory.log");
+        for (auto* ing : ingredients) {
+            if (ing->getQuantity() < 0) ing->setQuantity(0);
+        }
+    }
+
+    // Writes the full snapshot, starts a fresh log and waits for the disk
+    void saveToFile() {
+        {
+            unique_lock<shared_mutex> catalog(catalogMutex);
+            lock_guard<mutex> lock(logMutex);
+            persistence->drain("inventory.txt");
+            if (!rotateLog()) {
+                throw string("Cannot rotate inventory log");
+            }
+            persistence->submit("inventory.txt", serialize(), PersistenceQueue::REPLACE, writeSnapshot);
+            persistence->submit("forecast.txt", serializeForecast());
+        }
+        persistence->barrier();
+    }
+
+    // Carries on the consumption rates saved by the last saveToFile
+    void loadForecast() {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        RecordReader reader("forecast.txt");
+        reader.forEach([&]() {
+            Ingredient* ing = lookup(reader.text(0));
+            if (!ing) return;
+            ing->getConsumption().setState({ reader.number(1), reader.number(2), reader.number(3) });
+        });
+    }
+
+    // Every ingredient with its time to stockout, most urgent first
+    vector<StockForecast> forecastStockouts() const {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        double now = clockHours();
+        vector<StockForecast> forecasts;
+        forecasts.reserve(ingredients.size());
+        for (auto* ing : ingredients) {
+            double quantity = ing->getQuantity();
+            double rate = ing->getConsumption().perHour(now);
+            forecasts.push_back({ ing, quantity, rate,
+                rate > 0 ? quantity / rate : numeric_limits<double>::infinity() });
+        }
+        sort(forecasts.begin(), forecasts.end(), [](const StockForecast& a, const StockForecast& b) {
+            if (a.hoursLeft != b.hoursLeft) return a.hoursLeft < b.hoursLeft;
+            return a.perHour > b.perHour;
+        });
+        return forecasts;
+    }
+
+    vector<Ingredient*> getIngredients() const {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        return ingredients;
+    }
+
+    // Applies a supplier price list as one transaction; defined with the
+    // price list reader
+    PriceImport importPrices(const vector<PriceUpdate>& updates, double budget);
+
+    // Holds off every price and stock change while it is held; checkout
+    // waits too, so keep it short
+    unique_lock<shared_mutex> lockCatalog() {
+        return unique_lock<shared_mutex>(catalogMutex);
+    }
+
+    // Appends the catalog to a cafe.snap payload; `indexOf` receives each
+    // ingredient's position so recipes can refer to it by number
+    void saveBinary(BinaryWriter& out, unordered_map<const Ingredient*, uint32_t>& indexOf) const {
+        shared_lock<shared_mutex> catalog(catalogMutex);
+        out.put<uint32_t>((uint32_t)ingredients.size());
+        for (uint32_t i = 0; i < ingredients.size(); i++) {
+            const Ingredient* ing = ingredients[i];
+            indexOf[ing] = i;
+            out.putString(ing->getName());
+            out.putString(ing->getUnit());
+            out.put<double>(ing->getPrice());
+            out.put<double>(ing->getQuantity());
+        }
+    }
+
+    // Restores the catalog written by saveBinary; `byIndex` receives the
+    // ingredients in saved order
+    void loadBinary(BinaryReader& in, vector<Ingredient*>& byIndex) {
+        unique_lock<shared_mutex> catalog(catalogMutex);
+        uint32_t count = in.get<uint32_t>();
+        ingredients.reserve(count);
+        index.reserve(count);
+        byIndex.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            string name = in.getString();
+            string unit = in.getString();
+            double price = in.get<double>();
+            double quantity = in.get<double>();
+
+            Ingredient* ing = pool.create(name, price, quantity, unit);
+            insertIngredient(ing);
+            byIndex.push_back(ing);
+        }
+    }
+};
+
+#pragma region Preparations
+// One line of a recipe as written: an ingredient or a preparation, and how
+// much of it goes in
+struct RecipeComponent {
+    Ingredient* ingredient;
+    Preparation* preparation;
+    double quantity;
+
+    string getName() const;
+};
+
+// A bill of materials: every ingredient a recipe takes out of stock, once
+typedef vector<pair<Ingredient*, double>> FlatRecipe;
+
+// The line for `ingredient`, or nullptr when the recipe does not use it
+const pair<Ingredient*, double>* findInFlatRecipe(const FlatRecipe& flat, const Ingredient* ingredient) {
+    for (const auto& line : flat) {
+        if (line.first == ingredient) return &line;
+    }
+    return nullptr;
+}
+
+void addToFlatRecipe(FlatRecipe& flat, Ingredient* ingredient, double quantity) {
+    for (auto& line : flat) {
+        if (line.first == ingredient) {
+            line.second += quantity;
+            return;
+        }
+    }
+    flat.push_back({ ingredient, quantity });
+}
+
+// Adds the flat form of `components`; a preparation contributes its own
+// precompiled flat recipe, so this never goes deeper than one level
+void flattenRecipe(const vector<RecipeComponent>& components, FlatRecipe& flat);
+
+// A shared kitchen preparation (a sauce, a dough, a syrup) that recipes
+// use like an ingredient. Its recipe may use ingredients and other
+// preparations, in quantities per one unit of the preparation, and is
+// compiled into a flat recipe. A change recompiles it and everything built
+// on it, components before their users, so menu items never walk nested
+// recipes at checkout. Edits go through Cafe under the menu's writer lock.
+class Preparation {
+    string name;
+    vector<RecipeComponent> components;
+    FlatRecipe flattened;
+    // Preparations and menu items whose recipes use this one
+    vector<Preparation*> usedByPreparations;
+    vector<MenuItem*> usedByItems;
+
+public:
+    explicit Preparation(string name) : name(name) {}
+
+    string getName() const { return name; }
+    const vector<RecipeComponent>& getComponents() const { return components; }
+    const FlatRecipe& getFlattened() const { return flattened; }
+
+    // True when `other` is somewhere inside this recipe
+    bool uses(const Preparation* other) const {
+        for (const auto& component : components) {
+            if (component.preparation &&
+                (component.preparation == other || component.preparation->uses(other))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Adds a component without recompiling anything (loading); compileAll
+    // or changed() follow
+    void appendComponent(const RecipeComponent& component) {
+        if (component.preparation) {
+            if (component.preparation == this) {
+                throw string(name + " cannot contain itself");
+            }
+            if (component.preparation->uses(this)) {
+                throw string(name + " cannot contain " + component.preparation->getName() +
+                    ", which already contains it");
+            }
+            component.preparation->addUser(this);
+        }
+        components.push_back(component);
+    }
+
+    void addComponent(const RecipeComponent& component) {
+        appendComponent(component);
+        changed();
+    }
+
+    bool updateComponentQuantity(const string& componentName, double quantity) {
+        for (auto& component : components) {
+            if (equalsIgnoreCase(component.getName(), componentName)) {
+                component.quantity = quantity;
+                changed();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void addUser(Preparation* preparation) {
+        if (find(usedByPreparations.begin(), usedByPreparations.end(), preparation) == usedByPreparations.end()) {
+            usedByPreparations.push_back(preparation);
+        }
+    }
+
+    void addUser(MenuItem* item) {
+        if (find(usedByItems.begin(), usedByItems.end(), item) == usedByItems.end()) {
+            usedByItems.push_back(item);
+        }
+    }
+
+    void removeUser(MenuItem* item) {
+        auto found = find(usedByItems.begin(), usedByItems.end(), item);
+        if (found != usedByItems.end()) usedByItems.erase(found);
+    }
+
+    void compile() {
+        FlatRecipe previous = move(flattened);
+        flattened.clear();
+        flattenRecipe(components, flattened);
+        for (const auto& line : previous) {
+            if (!findInFlatRecipe(flattened, line.first)) line.first->removePreparationUser(this);
+        }
+        for (const auto& line : flattened) {
+            line.first->addPreparationUser(this);
+        }
+    }
+
+    // Drops every component that is `ingredient` itself and recompiles
+    bool removeIngredient(const Ingredient* ingredient) {
+        size_t before = components.size();
+        components.erase(remove_if(components.begin(), components.end(),
+            [ingredient](const RecipeComponent& component) { return component.ingredient == ingredient; }),
+            components.end());
+        if (components.size() == before) return false;
+        changed();
+        return true;
+    }
+
+    // Recompiles this preparation, the ones built on it and the menu items
+    // using any of them
+    void changed();
+
+    // Compiles every preparation after the ones it uses (loading)
+    static void compileAll(const vector<Preparation*>& preparations) {
+        unordered_set<const Preparation*> compiled;
+        function<void(Preparation*)> visit = [&](Preparation* preparation) {
+            if (!compiled.insert(preparation).second) return;
+            for (const auto& component : preparation->components) {
+                if (component.preparation) visit(component.preparation);
+            }
+            preparation->compile();
+        };
+        for (auto* preparation : preparations) {
+            visit(preparation);
+        }
+    }
+};
+
+string RecipeComponent::getName() const {
+    return ingredient ? ingredient->getName() : preparation->getName();
+}
+
+void flattenRecipe(const vector<RecipeComponent>& components, FlatRecipe& flat) {
+    for (const auto& component : components) {
+        if (component.ingredient) {
+            addToFlatRecipe(flat, component.ingredient, component.quantity);
+            continue;
+        }
+        for (const auto& line : component.preparation->getFlattened()) {
+            addToFlatRecipe(flat, line.first, line.second * component.quantity);
+        }
+    }
+}
+#pragma endregion
+
+#pragma region Bulk repricing
+// The menu's flat recipes as a sparse items x ingredients matrix in
+// compressed rows: row r holds its ingredient columns and quantities at
+// [rowStart[r], rowStart[r + 1]) of two contiguous arrays. Repricing the
+// whole menu is then one pass of the matrix times the ingredient price
+// vector, with no pointers to follow.
+class RecipeMatrix {
+    vector<uint32_t> rowStart;
+    vector<uint32_t> columns;
+    vector<double> quantities;
+    vector<double> basePrices;
+
+public:
+    RecipeMatrix() : rowStart(1, 0) {}
+
+    size_t rowCount() const { return basePrices.size(); }
+    size_t entryCount() const { return columns.size(); }
+
+    void clear() {
+        rowStart.assign(1, 0);
+        columns.clear();
+        quantities.clear();
+        basePrices.clear();
+    }
+
+    void reserve(size_t rows, size_t entries) {
+        rowStart.reserve(rows + 1);
+        basePrices.reserve(rows);
+        columns.reserve(entries);
+        quantities.reserve(entries);
+    }
+
+    // Starts the next row; addEntry() fills it
+    void addRow(double basePrice) {
+        basePrices.push_back(basePrice);
+        rowStart.push_back(rowStart.back());
+    }
+
+    void addEntry(uint32_t column, double quantity) {
+        columns.push_back(column);
+        quantities.push_back(quantity);
+        rowStart.back()++;
+    }
+
+    // itemPrices[r] = basePrices[r] + sum of quantity * ingredientPrices[column]
+    // over row r. Plain indexed loops over local pointers, so the compiler
+    // sees no aliasing through members and can unroll and vectorize them.
+    void multiply(const double* ingredientPrices, double* itemPrices) const {
+        const uint32_t* start = rowStart.data();
+        const uint32_t* column = columns.data();
+        const double* quantity = quantities.data();
+        const double* base = basePrices.data();
+        const size_t rows = basePrices.size();
+        for (size_t r = 0; r < rows; r++) {
+            double total = base[r];
+            for (uint32_t k = start[r], end = start[r + 1]; k < end; k++) {
+                total += quantity[k] * ingredientPrices[column[k]];
+            }
+            itemPrices[r] = total;
+        }
+    }
+};
+#pragma endregion
+
+// The price is computed once and cached. It is refreshed when the base
+// price or the recipe changes here, and by Ingredient::setPrice for every
+// item that uses the ingredient, so reading it never walks the recipe.
+// The portions the stock can make are cached too, but recounted on read: a
+// stock change only bumps stockChanges of the items using the ingredient,
+// so tills taking stock never wait on priceMutex.
+// Recipe changes, refreshes and recounts hold priceMutex.
+// `components` is the recipe as written, which may use preparations;
+// `ingredients` is its flat form, the only one pricing and checkout read.
+class MenuItem {
+protected:
+    string name;
+    double basePrice;
+    vector<RecipeComponent> components;
+    FlatRecipe ingredients;
+    atomic<double> cachedPrice;
+    mutable atomic<int> cachedPortions;
+    // Stock changes of the recipe's ingredients, and how many of them
+    // cachedPortions has seen
+    atomic<unsigned> stockChanges;
+    mutable atomic<unsigned> countedChanges;
+    mutable mutex priceMutex;
+
+    // Bumped by every recipe or base price change of any item, so a
+    // RecipeMatrix built from the menu can tell that it is out of date
+    inline static atomic<uint64_t> recipeRevision{ 0 };
+
+    // Caller holds priceMutex
+    void recomputePrice() {
+        double total = basePrice;
+        for (const auto& pair : ingredients) {
+            Ingredient* ing = pair.first;
+            double qty = pair.second;
+            total += ing->getPrice() * qty;
+        }
+        cachedPrice.store(total, memory_order_release);
+    }
+
+    // Caller holds priceMutex. The change count is read before the stock,
+    // so the count stored covers every change the stock read reflects.
+    void recomputePortions() const {
+        unsigned changes = stockChanges.load(memory_order_acquire);
+        double portions = INT_MAX;
+        for (const auto& pair : ingredients) {
+            if (pair.second <= 0) continue;
+            // The tolerance keeps 1.0 / 0.1 from counting as 9 portions
+            portions = min(portions, floor(pair.first->getQuantity() / pair.second + 1e-9));
+        }
+        cachedPortions.store((int)portions, memory_order_release);
+        countedChanges.store(changes, memory_order_release);
+    }
+
+    void recomputeRecipe(bool price) {
+        if (price) recomputePrice();
+        recomputePortions();
+    }
+
+public:
+    MenuItem(string name, double basePrice)
+        : name(name), basePrice(basePrice), cachedPrice(basePrice), cachedPortions(INT_MAX),
+        stockChanges(0), countedChanges(0) {}
+    MenuItem(const MenuItem& other)
+        : cachedPrice(other.basePrice), cachedPortions(INT_MAX), stockChanges(0), countedChanges(0) {
+        this->name = other.name;
+        this->basePrice = other.basePrice;
+    }
+    MenuItem& operator=(const MenuItem& other) {
+        this->name = other.name;
+        this->basePrice = other.basePrice;
+        refreshPrice();
+        return *this;
+    }
+    virtual ~MenuItem() {}
+
+    string getName() const { return name; }
+    double getBasePrice() const { return basePrice; }
+
+    void setBasePrice(double price) {
+        lock_guard<mutex> lock(priceMutex);
+        basePrice = price;
+        recipeRevision++;
+        recomputePrice();
+    }
+
+    static uint64_t getRecipeRevision() { return recipeRevision.load(); }
+
+    // Stores a price computed elsewhere from the current recipe and
+    // ingredient prices (Cafe::repriceMenu)
+    void storePrice(double price) {
+        cachedPrice.store(price, memory_order_release);
+    }
+
+    void addIngredient(Ingredient* ingredient, double quantity) {
+        components.push_back({ ingredient, nullptr, quantity });
+        recompile();
+    }
+
+    void addPreparation(Preparation* preparation, double quantity) {
+        preparation->addUser(this);
+        components.push_back({ nullptr, preparation, quantity });
+        recompile();
+    }
+
+    // Sets a whole recipe at once, compiling it a single time (loading).
+    // Without `price` the cached price is left for the caller to set, as
+    // the loaders do for the whole menu with Cafe::repriceMenu.
+    void setComponents(const vector<RecipeComponent>& recipe, bool price = true) {
+        for (const auto& component : recipe) {
+            if (component.preparation) component.preparation->addUser(this);
+        }
+        components = recipe;
+        recompile(price);
+    }
+
+    // Rebuilds the flat recipe from the components. Ingredients learn about
+    // this item, or that it no longer uses them, before priceMutex is
+    // taken: Ingredient::setPrice takes the two locks the other way round.
+    void recompile(bool price = true) {
+        FlatRecipe flat;
+        flattenRecipe(components, flat);
+        for (const auto& pair : ingredients) {
+            if (!findInFlatRecipe(flat, pair.first)) pair.first->removeDependent(this);
+        }
+        for (const auto& pair : flat) {
+            pair.first->addDependent(this);
+        }
+        lock_guard<mutex> lock(priceMutex);
+        ingredients = move(flat);
+        recipeRevision++;
+        recomputeRecipe(price);
+    }
+
+    void refreshPrice() {
+        lock_guard<mutex> lock(priceMutex);
+        recomputePrice();
+    }
+
+    void noteStockChange() {
+        stockChanges.fetch_add(1, memory_order_release);
+    }
+
+    virtual double calculatePrice() const {
+        return cachedPrice.load(memory_order_acquire);
+    }
+
+    // Whole portions the current stock makes; INT_MAX without a recipe
+    int getPortionsAvailable() const {
+        if (countedChanges.load(memory_order_acquire) != stockChanges.load(memory_order_acquire)) {
+            lock_guard<mutex> lock(priceMutex);
+            if (countedChanges.load(memory_order_acquire) != stockChanges.load(memory_order_acquire)) {
+                recomputePortions();
+            }
+        }
+        return cachedPortions.load(memory_order_acquire);
+    }
+
+    bool isSoldOut() const { return getPortionsAvailable() == 0; }
+
+    virtual string getType() const = 0;
+
+    const FlatRecipe& getIngredients() const {
+        return ingredients;
+    }
+
+    const vector<RecipeComponent>& getComponents() const {
+        return components;
+    }
+
+    // Drops every component that is `ingredient` itself and recompiles
+    bool removeIngredient(const Ingredient* ingredient) {
+        size_t before = components.size();
+        components.erase(remove_if(components.begin(), components.end(),
+            [ingredient](const RecipeComponent& component) { return component.ingredient == ingredient; }),
+            components.end());
+        if (components.size() == before) return false;
+        recompile();
+        return true;
+    }
+
+    // Takes the item out of the reverse indexes of everything its recipe
+    // uses, once it has left the menu
+    void detach() {
+        for (const auto& pair : ingredients) {
+            pair.first->removeDependent(this);
+        }
+        for (const auto& component : components) {
+            if (component.preparation) component.preparation->removeUser(this);
+        }
+    }
+
+    // Changes one line of the recipe as written: an ingredient or a whole
+    // preparation, not an ingredient inside a preparation
+    bool updateIngredientQuantity(const string& ingName, double newQty) {
+        for (auto& component : components) {
+            if (equalsIgnoreCase(component.getName(), ingName)) {
+                component.quantity = newQty;
+                recompile();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void showMenuItemIngr() const {
+        cout << "\nIngredients are below:\n";
+        for (auto& component : components) {
+            cout << component.getName() << " - " << component.quantity << "\n";
+        }
+    }
+
+    /*MenuItem* createModifiedCopy() const {
+        MenuItem* copy = (getType() == "Drink") ?
+            static_cast<MenuItem*>(new Drink(name, basePrice)) :
+            static_cast<MenuItem*>(new Dish(name, basePrice));
+
+        for (const auto& pair : ingredients) {
+            copy->addIngredient(pair.first, pair.second);
+        }
+        return copy;
+    }*/
+};
+
+void Ingredient::setPrice(double price) {
+    if (price < 0) {
+        throw string("Price cannot be negative");
+    }
+    this->price.store(price, memory_order_relaxed);
+    for (auto* item : *atomic_load(&dependents)) {
+        item->refreshPrice();
+    }
+}
+
+void Preparation::changed() {
+    // Depth-first over the users; the postorder puts every preparation
+    // after the ones built on it, so compiling it backwards goes components
+    // first
+    vector<Preparation*> order;
+    unordered_set<const Preparation*> seen;
+    function<void(Preparation*)> visit = [&](Preparation* preparation) {
+        if (!seen.insert(preparation).second) return;
+        for (auto* user : preparation->usedByPreparations) visit(user);
+        order.push_back(preparation);
+    };
+    visit(this);
+
+    vector<MenuItem*> items;
+    unordered_set<const MenuItem*> seenItems;
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        (*it)->compile();
+        for (auto* item : (*it)->usedByItems) {
+            if (seenItems.insert(item).second) items.push_back(item);
+        }
+    }
+    for (auto* item : items) {
+        item->recompile();
+    }
+}
+
+void Ingredient::noteStockChange() const {
+    for (auto* item : *atomic_load(&dependents)) {
+        item->noteStockChange();
+    }
+}
+
+class Dish : public MenuItem {
+public:
+    Dish(string name, double basePrice) : MenuItem(name, basePrice) {}
+    string getType() const override { return "Dish"; }
+};
+
+class Drink : public MenuItem {
+public:
+    Drink(string name, double basePrice) : MenuItem(name, basePrice) {}
+    string getType() const override { return "Drink"; }
+};
+
+#pragma region Supplier price lists
+// One line of a supplier price list
+struct PriceUpdate {
+    string name;
+    double price;
+    bool hasQuantity;
+    double quantity;
+    size_t line;
+};
+
+// What an import changed. Only menu items whose computed price moved are
+// listed; costs are at the new prices.
+struct PriceImport {
+    struct IngredientChange {
+        Ingredient* ingredient;
+        double oldPrice;
+        double newPrice;
+        double oldQuantity;
+        double newQuantity;
+    };
+    struct ItemChange {
+        MenuItem* item;
+        double oldPrice;
+        double newPrice;
+    };
+
+    vector<IngredientChange> ingredients;
+    vector<ItemChange> items;
+    double restockCost;      // for stock added by the list
+    double stockValueChange; // value of the stock on hand, after minus before
+    double budget;           // when the import started
+};
+
+string_view trimField(string_view field) {
+    while (!field.empty() && isspace((unsigned char)field.front())) field.remove_prefix(1);
+    while (!field.empty() && isspace((unsigned char)field.back())) field.remove_suffix(1);
+    if (field.size() >= 2 && field.front() == '"' && field.back() == '"') {
+        field = field.substr(1, field.size() - 2);
+    }
+    return field;
+}
+
+// Supplier price lists are CSV, one "ingredient,price[,quantity]" per line.
+// Blank lines, lines starting with '#' and a first record naming the
+// columns ("name,..." or "ingredient,...") are skipped, and
+// fields may be padded or quoted. A quantity replaces the stock on hand, as
+// Update Ingredient does; without one the stock is kept. Any bad line
+// rejects the whole list.
+vector<PriceUpdate> readPriceList(const string& path) {
+    RecordReader reader(path, 0, ',');
+    if (!reader.isOpen()) {
+        throw string("Cannot open " + path);
+    }
+
+    auto number = [&](string_view field, const char* what) {
+        double value = 0;
+        auto parsed = from_chars(field.data(), field.data() + field.size(), value);
+        if (field.empty() || parsed.ec != errc() || parsed.ptr != field.data() + field.size()) {
+            throw reader.error(string(what) + " '" + string(field) + "' is not a number");
+        }
+        if (value < 0) {
+            throw reader.error(string(what) + " cannot be negative");
+        }
+        return value;
+    };
+
+    vector<PriceUpdate> updates;
+    bool sawRecord = false;
+    while (reader.next()) {
+        string_view name = trimField(reader.field(0));
+        if (name.empty() || name.front() == '#') continue;
+
+        bool first = !sawRecord;
+        sawRecord = true;
+        if (first && (equalsIgnoreCase(string(name), "name") || equalsIgnoreCase(string(name), "ingredient"))) {
+            continue;
+        }
+
+        PriceUpdate update = { string(name), number(trimField(reader.field(1)), "price"), false, 0, reader.lineNumber() };
+        if (reader.fieldCount() > 2 && !trimField(reader.field(2)).empty()) {
+            update.hasQuantity = true;
+            update.quantity = number(trimField(reader.field(2)), "quantity");
+        }
+        updates.push_back(update);
+    }
+    if (updates.empty()) {
+        throw string(path + " has no prices");
+    }
+    return updates;
+}
+
+// Every line is checked before anything changes, and a list that would
+// restock for more than `budget` is refused, as Update Ingredient refuses.
+// Tills wait on the catalog while the list is applied. Each affected menu
+// item is re-priced once, after all prices are in; items that use none of
+// the changed ingredients are not touched. The list reaches disk as one
+// inventory snapshot write. If that write fails, every change is undone.
+PriceImport Inventory::importPrices(const vector<PriceUpdate>& updates, double budget) {
+    unique_lock<shared_mutex> catalog(catalogMutex);
+    lock_guard<mutex> lock(logMutex);
+
+    PriceImport result = { {}, {}, 0, 0, budget };
+    unordered_map<const Ingredient*, size_t> changeOf;
+    for (const auto& update : updates) {
+        Ingredient* ing = lookup(update.name);
+        if (!ing) {
+            throw string("Price list line " + to_string(update.line) + ": unknown ingredient " + update.name);
+        }
+        // A later line for the same ingredient wins
+        auto found = changeOf.emplace(ing, result.ingredients.size());
+        if (found.second) {
+            double price = ing->getPrice();
+            double quantity = ing->getQuantity();
+            result.ingredients.push_back({ ing, price, price, quantity, quantity });
+        }
+        auto& change = result.ingredients[found.first->second];
+        change.newPrice = update.price;
+        if (update.hasQuantity) change.newQuantity = update.quantity;
+    }
+
+    for (const auto& change : result.ingredients) {
+        result.restockCost += max(0.0, change.newQuantity - change.oldQuantity) * change.newPrice;
+        result.stockValueChange += change.newQuantity * change.newPrice - change.oldQuantity * change.oldPrice;
+    }
+    if (result.restockCost > budget) {
+        ostringstream message;
+        message << fixed << setprecision(2) << "Can't import due to budgetary restrictions: restocking costs $"
+            << result.restockCost << " of a $" << budget << " budget";
+        throw message.str();
+    }
+
+    unordered_set<const MenuItem*> affected;
+    for (const auto& change : result.ingredients) {
+        if (change.newPrice == change.oldPrice) continue;
+        for (auto* item : *change.ingredient->getDependents()) {
+            if (affected.insert(item).second) result.items.push_back({ item, item->calculatePrice(), 0 });
+        }
+    }
+
+    auto apply = [&](bool forward) {
+        for (const auto& change : result.ingredients) {
+            change.ingredient->storePrice(forward ? change.newPrice : change.oldPrice);
+            change.ingredient->setQuantity(forward ? change.newQuantity : change.oldQuantity);
+        }
+        for (const auto& item : result.items) {
+            item.item->refreshPrice();
+        }
+    };
+    apply(true);
+
+    // Waiting on this one file rather than a barrier() leaves other files'
+    // failures to whoever wrote them
+    persistence->drain("inventory.txt");
+    auto written = make_shared<bool>(false);
+    if (rotateLog()) {
+        persistence->submit("inventory.txt", serialize(), PersistenceQueue::REPLACE,
+            [written](const string& snapshot) { return *written = writeSnapshot(snapshot); });
+        persistence->drain("inventory.txt");
+    }
+    if (!*written) {
+        apply(false);
+        throw string("Cannot write inventory.txt, the price list was not applied");
+    }
+
+    for (auto& item : result.items) {
+        item.newPrice = item.item->calculatePrice();
+    }
+    result.items.erase(remove_if(result.items.begin(), result.items.end(), [](const PriceImport::ItemChange& item) {
+        return fabs(item.newPrice - item.oldPrice) < 1e-9;
+        }), result.items.end());
+    return result;
+}
+#pragma endregion
+
+#pragma region Order detail log
+// Dense numbers for the menu item and ingredient names that appear in
+// the order detail log, so detail records carry fixed-width ids instead of
+// names. New names get the next id when an order is formatted; the
+// committer appends them to order_dictionary.txt before the records that
+// use them. Ids are never reused, renamed items keep their old entry.
+//   item;id;name  or  ingredient;id;name
+class OrderDictionary {
+public:
+    enum Kind { ITEM, INGREDIENT };
+
+private:
+    vector<string> names[2];
+    unordered_map<string, uint32_t> ids[2];
+    string pending;
+    mutable mutex dictionaryMutex;
+
+    static const char* tag(Kind kind) {
+        return kind == ITEM ? "item" : "ingredient";
+    }
+
+    uint32_t add(Kind kind, const string& name) {
+        uint32_t id = (uint32_t)names[kind].size();
+        names[kind].push_back(name);
+        ids[kind].emplace(name, id);
+        return id;
+    }
+
+public:
+    // `repair` drops a torn tail from the file; tools that only read pass false
+    void loadFromFile(bool repair = true) {
+        lock_guard<mutex> lock(dictionaryMutex);
+        for (int kind = ITEM; kind <= INGREDIENT; kind++) {
+            names[kind].clear();
+            ids[kind].clear();
+        }
+        pending.clear();
+
+        size_t validBytes = 0;
+        {
+            RecordReader reader("order_dictionary.txt");
+            while (reader.next() && reader.isTerminated()) {
+                validBytes = reader.offset();
+                try {
+                    string_view kindTag = reader.field(0);
+                    Kind kind = kindTag == "item" ? ITEM : INGREDIENT;
+                    if (kind == INGREDIENT && kindTag != "ingredient") {
+                        throw reader.error("unknown entry '" + string(kindTag) + "'");
+                    }
+                    if (reader.integer(1) != (long long)names[kind].size()) {
+                        throw reader.error("id " + reader.text(1) + " is out of sequence");
+                    }
+                    add(kind, reader.text(2));
+                }
+                catch (const string& e) {
+                    cerr << e << "\n";
+                }
+            }
+        }
+
+        error_code ec;
+        if (repair && filesystem::exists("order_dictionary.txt", ec) &&
+            filesystem::file_size("order_dictionary.txt", ec) > validBytes) {
+            // Drop the torn tail of an interrupted append
+            filesystem::resize_file("order_dictionary.txt", validBytes, ec);
+        }
+    }
+
+    uint32_t idOf(Kind kind, const string& name) {
+        lock_guard<mutex> lock(dictionaryMutex);
+        auto found = ids[kind].find(name);
+        if (found != ids[kind].end()) return found->second;
+
+        uint32_t id = add(kind, name);
+        pending += string(tag(kind)) + ";" + to_string(id) + ";" + name + "\n";
+        return id;
+    }
+
+    string nameOf(Kind kind, uint32_t id) const {
+        lock_guard<mutex> lock(dictionaryMutex);
+        if (id >= names[kind].size()) {
+            throw string("order_dictionary.txt has no " + string(tag(kind)) + " " + to_string(id));
+        }
+        return names[kind][id];
+    }
+
+    // Makes the ids handed out so far durable
+    void sync() {
+        string added;
+        {
+            lock_guard<mutex> lock(dictionaryMutex);
+            added.swap(pending);
+        }
+        if (added.empty()) return;
+
+        FILE* file = openFile("order_dictionary.txt", "ab");
+        bool ok = file && fwrite(added.data(), 1, added.size(), file) == added.size() && syncFile(file);
+        if (file) fclose(file);
+        if (!ok) {
+            lock_guard<mutex> lock(dictionaryMutex);
+            pending.insert(0, added);
+            throw string("Cannot write order dictionary");
+        }
+    }
+};
+
+// One line of an order as stored in a detail log, the .details.bin file of
+// an order log segment. After the 8-byte file header "CAFEODB1" every
+// record is framed by its own length, so a reader steps over one without
+// decoding it:
+//   u16 record length, u32 order id, u32 item id, u32 quantity,
+//   i32 price in 1/10000, u16 ingredient count,
+//   then per ingredient: u32 ingredient id, i32 quantity in 1/1000
+struct DetailRecord {
+    static constexpr size_t BASE_SIZE = 2 + 4 + 4 + 4 + 4 + 2;
+    static constexpr size_t INGREDIENT_SIZE = 4 + 4;
+    static constexpr double PRICE_SCALE = 10000;
+    static constexpr double QUANTITY_SCALE = 1000;
+
+    uint32_t orderId;
+    uint32_t itemId;
+    uint32_t quantity;
+    double price;
+    vector<pair<uint32_t, double>> ingredients;
+
+    static int32_t toFixed(double value, double scale) {
+        double scaled = round(value * scale);
+        if (!(scaled >= INT32_MIN && scaled <= INT32_MAX)) {
+            throw string("order detail value " + to_string(value) + " is out of range");
+        }
+        return (int32_t)scaled;
+    }
+
+    void appendTo(BinaryWriter& out) const {
+        size_t length = BASE_SIZE + INGREDIENT_SIZE * ingredients.size();
+        if (length > UINT16_MAX) {
+            throw string("order line has too many ingredients");
+        }
+        out.put<uint16_t>((uint16_t)length);
+        out.put<uint32_t>(orderId);
+        out.put<uint32_t>(itemId);
+        out.put<uint32_t>(quantity);
+        out.put<int32_t>(toFixed(price, PRICE_SCALE));
+        out.put<uint16_t>((uint16_t)ingredients.size());
+        for (const auto& ingredient : ingredients) {
+            out.put<uint32_t>(ingredient.first);
+            out.put<int32_t>(toFixed(ingredient.second, QUANTITY_SCALE));
+        }
+    }
+};
+
+// Walks the records of a detail log (mapped, from a byte offset) or of
+// records already in memory. A record cut short by an interrupted write
+// ends the walk with isComplete() false; a record whose length does not
+// match its ingredient count throws and is stepped over.
+class DetailRecordReader {
+    string name;
+    unique_ptr<MappedFile> file;
+    string_view buffer;
+    size_t position;
+    bool complete;
+    DetailRecord current;
+
+    // Length of the record at the current position, 0 at the end
+    size_t frame() {
+        size_t remaining = buffer.size() - position;
+        if (remaining == 0) return 0;
+
+        uint16_t length = 0;
+        if (remaining >= sizeof(length)) memcpy(&length, buffer.data() + position, sizeof(length));
+        if (remaining < DetailRecord::BASE_SIZE || length < DetailRecord::BASE_SIZE || length > remaining) {
+            complete = false;
+            return 0;
+        }
+        return length;
+    }
+
+public:
+    static constexpr const char* MAGIC = "CAFEODB1";
+    static constexpr size_t HEADER_SIZE = 8;
+
+    explicit DetailRecordReader(const string& path, size_t startOffset = 0)
+        : name(path), file(new MappedFile(path)), position(0), complete(true) {
+        buffer = string_view(file->data() ? file->data() : "", file->size());
+        if (buffer.size() < HEADER_SIZE) {
+            buffer = string_view(); // missing, or the header is still being written
+            return;
+        }
+        if (buffer.substr(0, HEADER_SIZE) != MAGIC) {
+            throw string(path + " is not an order detail log");
+        }
+        position = min(max(startOffset, HEADER_SIZE), buffer.size());
+    }
+
+    DetailRecordReader(string_view records, const string& name)
+        : name(name), buffer(records), position(0), complete(true) {}
+
+    // Moves past the next record without decoding it
+    bool skip() {
+        size_t length = frame();
+        position += length;
+        return length > 0;
+    }
+
+    bool next() {
+        size_t length = frame();
+        if (length == 0) return false;
+
+        BinaryReader in(buffer.substr(position, length));
+        size_t start = position;
+        position += length;
+
+        in.get<uint16_t>();
+        current.orderId = in.get<uint32_t>();
+        current.itemId = in.get<uint32_t>();
+        current.quantity = in.get<uint32_t>();
+        current.price = in.get<int32_t>() / DetailRecord::PRICE_SCALE;
+        uint16_t count = in.get<uint16_t>();
+        if (length != DetailRecord::BASE_SIZE + DetailRecord::INGREDIENT_SIZE * count) {
+            throw string(name + "@" + to_string(start) + ": record length does not match its contents");
+        }
+        current.ingredients.clear();
+        for (uint16_t i = 0; i < count; i++) {
+            uint32_t ingredient = in.get<uint32_t>();
+            current.ingredients.push_back({ ingredient, in.get<int32_t>() / DetailRecord::QUANTITY_SCALE });
+        }
+        return true;
+    }
+
+    const DetailRecord& record() const { return current; }
+    // False once the walk stopped at a partly written record
+    bool isComplete() const { return complete; }
+    // Byte offset just past the current record
+    size_t offset() const { return position; }
+};
+
+// Creates a detail log with its header if there is none yet and cuts off a
+// record left half written by an interrupted append, so new records are
+// framed right. Only the length of each record is read.
+void initDetailLog(const string& path) {
+    error_code ec;
+    if (filesystem::exists(path, ec) &&
+        filesystem::file_size(path, ec) >= DetailRecordReader::HEADER_SIZE) {
+        size_t validBytes;
+        {
+            DetailRecordReader reader(path);
+            while (reader.skip()) {}
+            if (reader.isComplete()) return;
+            validBytes = reader.offset();
+        }
+        filesystem::resize_file(path, validBytes, ec);
+        if (ec) {
+            throw string("Cannot repair " + path);
+        }
+        return;
+    }
+    FILE* file = openFile(path, "wb");
+    bool ok = file && fwrite(DetailRecordReader::MAGIC, 1, DetailRecordReader::HEADER_SIZE, file) ==
+        DetailRecordReader::HEADER_SIZE && syncFile(file);
+    if (file) fclose(file);
+    if (!ok) {
+        throw string("Cannot create " + path);
+    }
+}
+
+// Rewrites the text order_details.txt as order_details.bin, keeping the text
+// file as order_details.txt.old; the next start moves it into logs/. The
+// order history index points into the old file, so it is dropped and
+// rebuilt.
+size_t convertDetailLog(OrderDictionary& dictionary) {
+    error_code ec;
+    if (filesystem::exists("order_details.bin", ec) || filesystem::exists("logs", ec)) {
+        throw string("The order details are already in the binary format");
+    }
+
+    BinaryWriter out;
+    out.putBytes(DetailRecordReader::MAGIC);
+    size_t converted = 0;
+
+    RecordReader reader("order_details.txt");
+    if (!reader.isOpen()) {
+        throw string("Cannot open order_details.txt");
+    }
+    DetailRecord record;
+    reader.forEach([&]() {
+        record.orderId = (uint32_t)reader.integer(0);
+        record.itemId = dictionary.idOf(OrderDictionary::ITEM, reader.text(1));
+        record.quantity = (uint32_t)reader.integer(2);
+        record.price = reader.number(3);
+
+        record.ingredients.clear();
+        string_view ingredients = reader.fieldCount() > 4 ? reader.field(4) : string_view();
+        while (!ingredients.empty()) {
+            size_t comma = ingredients.find(',');
+            string_view entry = ingredients.substr(0, comma);
+            size_t colon = entry.rfind(':');
+            double quantity = 0;
+            if (colon != string_view::npos) {
+                from_chars(entry.data() + colon + 1, entry.data() + entry.size(), quantity);
+            }
+            record.ingredients.push_back({ dictionary.idOf(OrderDictionary::INGREDIENT, string(entry.substr(0, colon))), quantity });
+            ingredients = comma == string_view::npos ? string_view() : ingredients.substr(comma + 1);
+        }
+        record.appendTo(out);
+        converted++;
+    });
+    dictionary.sync();
+
+    FILE* file = openFile("order_details.bin.tmp", "wb");
+    bool written = file && fwrite(out.data().data(), 1, out.data().size(), file) == out.data().size() && syncFile(file);
+    if (file) fclose(file);
+    if (written) filesystem::rename("order_details.bin.tmp", "order_details.bin", ec);
+    if (!written || ec) {
+        throw string("Cannot write order_details.bin");
+    }
+
+    filesystem::rename("order_details.txt", "order_details.txt.old", ec);
+    filesystem::remove("order_index.txt", ec);
+    return converted;
+}
+
+// Prints a detail log in the old text layout
+//   orderId;item;quantity;price;ingredient:quantity,...
+void dumpDetailLog(const OrderDictionary& dictionary, const string& path, ostream& out) {
+    DetailRecordReader reader(path);
+    while (true) {
+        try {
+            if (!reader.next()) break;
+        }
+        catch (const string& e) {
+            cerr << e << "\n";
+            continue;
+        }
+        const DetailRecord& record = reader.record();
+        out << record.orderId << ";"
+            << dictionary.nameOf(OrderDictionary::ITEM, record.itemId) << ";"
+            << record.quantity << ";"
+            << record.price << ";";
+        for (size_t i = 0; i < record.ingredients.size(); i++) {
+            if (i > 0) out << ",";
+            out << dictionary.nameOf(OrderDictionary::INGREDIENT, record.ingredients[i].first) << ":"
+                << record.ingredients[i].second;
+        }
+        out << "\n";
+    }
+    if (!reader.isComplete()) {
+        cerr << path << " ends in a partly written record\n";
+    }
+}
+#pragma endregion
+
+#pragma region Segmented order logs
+// Orders, order lines and daily sales are logged in numbered segments under
+// logs/ rather than in three files that grow forever. Batches go to the hot
+// segment, the last one, which is sealed and replaced once the day changes
+// or it passes SEGMENT_BYTES. Sealing writes a manifest with the segment's
+// date range, order id range and totals: date-bounded readers skip the
+// segments outside their range, daily totals are rebuilt from manifests
+// alone, and sealed segments can move to logs/archive/ while the hot one
+// keeps taking orders.
+//   logs/000001.orders.txt  000001.details.bin  000001.stats.txt
+//   logs/000001.manifest:
+//     firstDay;lastDay;firstOrderId;lastOrderId;orderCount;total
+//     day;amount          (one line per day with sales)
+class SegmentedLog {
+public:
+    enum Part { ORDERS, DETAILS, STATS, MANIFEST };
+
+    struct Segment {
+        uint32_t number = 0;
+        bool sealed = false;
+        bool archived = false;
+        int firstDay = INT_MAX;
+        int lastDay = INT_MIN;
+        long long firstOrderId = 0;
+        long long lastOrderId = 0;
+        size_t orderCount = 0;
+        double total = 0;
+        vector<pair<int, double>> dailyTotals;
+        long long bytes = 0;
+
+        bool overlaps(int fromDay, int toDay) const {
+            return firstDay < toDay && lastDay >= fromDay;
+        }
+
+        void addDay(int day) {
+            firstDay = min(firstDay, day);
+            lastDay = max(lastDay, day);
+        }
+
+        void addOrder(long long orderId, int day, double amount) {
+            firstOrderId = orderCount > 0 ? min(firstOrderId, orderId) : orderId;
+            lastOrderId = orderCount > 0 ? max(lastOrderId, orderId) : orderId;
+            orderCount++;
+            total += amount;
+            addDay(day);
+        }
+
+        void addSale(int day, double amount) {
+            addDay(day);
+            auto it = lower_bound(dailyTotals.begin(), dailyTotals.end(), day,
+                [](const pair<int, double>& entry, int value) { return entry.first < value; });
+            if (it == dailyTotals.end() || it->first != day) {
+                it = dailyTotals.insert(it, { day, 0.0 });
+            }
+            it->second += amount;
+        }
+    };
+
+    // Where a batch went and how large each file of the segment is after it
+    struct Appended {
+        uint32_t segment;
+        long long ordersSize;
+        long long detailsSize;
+        long long statsSize;
+    };
+
+    static const long long SEGMENT_BYTES = 64LL << 20;
+
+private:
+    vector<Segment> segments; // segments[i].number == i + 1
+    mutable mutex logMutex;
+
+    static string fileName(uint32_t number, Part part) {
+        static const char* const suffixes[] = { ".orders.txt", ".details.bin", ".stats.txt", ".manifest" };
+        char name[16];
+        snprintf(name, sizeof(name), "%06u", number);
+        return name + string(suffixes[part]);
+    }
+
+    static string locate(const Segment& segment, Part part) {
+        return (segment.archived ? "logs/archive/" : "logs/") + fileName(segment.number, part);
+    }
+
+    static bool segmentExists(uint32_t number) {
+        error_code ec;
+        for (Part part : { ORDERS, DETAILS, STATS, MANIFEST }) {
+            if (filesystem::exists("logs/" + fileName(number, part), ec) ||
+                filesystem::exists("logs/archive/" + fileName(number, part), ec)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the size of the file after the append
+    static long long appendAll(const string& path, const string& data) {
+        FILE* file = openFile(path, "ab");
+        if (!file) {
+            throw string("Cannot open " + path);
+        }
+        bool ok = data.empty() ||
+            (fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file));
+        seekFile(file, 0, SEEK_END);
+        long long size = tellFile(file);
+        fclose(file);
+        if (!ok) {
+            throw string("Cannot write " + path);
+        }
+        return size;
+    }
+
+    static void trim(const string& path, size_t validBytes) {
+        error_code ec;
+        if (filesystem::exists(path, ec) && filesystem::file_size(path, ec) > validBytes) {
+            filesystem::resize_file(path, validBytes, ec);
+        }
+    }
+
+    // Fold complete records into the segment's summary and return the offset
+    // just past the last of them
+    static size_t foldOrders(RecordReader& reader, Segment& segment) {
+        size_t validBytes = reader.offset();
+        while (reader.next() && reader.isTerminated()) {
+            validBytes = reader.offset();
+            try {
+                int day;
+                if (!parseDayNumber(reader.field(2), day)) {
+                    throw reader.error("'" + reader.text(2) + "' is not a date");
+                }
+                segment.addOrder(reader.integer(0), day, reader.number(3));
+            }
+            catch (const string& e) {
+                cerr << e << "\n";
+            }
+        }
+        return validBytes;
+    }
+
+    static size_t foldStats(RecordReader& reader, Segment& segment) {
+        size_t validBytes = reader.offset();
+        while (reader.next() && reader.isTerminated()) {
+            validBytes = reader.offset();
+            try {
+                int day;
+                if (!parseDayNumber(reader.field(0), day)) {
+                    throw reader.error("'" + reader.text(0) + "' is not a date");
+                }
+                segment.addSale(day, reader.number(1));
+            }
+            catch (const string& e) {
+                cerr << e << "\n";
+            }
+        }
+        return validBytes;
+    }
+
+    // Summarises a segment from its files. With `repair`, records left half
+    // written by an interrupted append are cut off so new ones line up.
+    static void scan(Segment& segment, bool repair) {
+        size_t ordersValid, statsValid;
+        {
+            RecordReader orders(locate(segment, ORDERS));
+            ordersValid = foldOrders(orders, segment);
+        }
+        {
+            RecordReader stats(locate(segment, STATS));
+            statsValid = foldStats(stats, segment);
+        }
+        if (repair) {
+            trim(locate(segment, ORDERS), ordersValid);
+            trim(locate(segment, STATS), statsValid);
+            initDetailLog(locate(segment, DETAILS));
+        }
+
+        error_code ec;
+        segment.bytes = 0;
+        for (Part part : { ORDERS, DETAILS, STATS }) {
+            uintmax_t size = filesystem::file_size(locate(segment, part), ec);
+            if (!ec) segment.bytes += (long long)size;
+        }
+    }
+
+    static bool loadManifest(Segment& segment) {
+        RecordReader reader(locate(segment, MANIFEST));
+        if (!reader.next() || !reader.isTerminated()) return false;
+        try {
+            if (!parseDayNumber(reader.field(0), segment.firstDay) || !parseDayNumber(reader.field(1), segment.lastDay)) {
+                throw reader.error("bad date range");
+            }
+            segment.firstOrderId = reader.integer(2);
+            segment.lastOrderId = reader.integer(3);
+            segment.orderCount = (size_t)reader.integer(4);
+            segment.total = reader.number(5);
+            while (reader.next()) {
+                int day;
+                if (!reader.isTerminated() || !parseDayNumber(reader.field(0), day)) {
+                    throw reader.error("bad daily total");
+                }
+                segment.dailyTotals.push_back({ day, reader.number(1) });
+            }
+        }
+        catch (const string& e) {
+            cerr << e << "\n";
+            return false;
+        }
+        segment.sealed = true;
+        return true;
+    }
+
+    static void seal(Segment& segment) {
+        // An empty segment gets the range of day 0, which no query asks for
+        bool empty = segment.firstDay > segment.lastDay;
+        ostringstream out;
+        out << setprecision(15)
+            << formatDayNumber(empty ? 0 : segment.firstDay) << ";"
+            << formatDayNumber(empty ? 0 : segment.lastDay) << ";"
+            << segment.firstOrderId << ";" << segment.lastOrderId << ";"
+            << segment.orderCount << ";" << segment.total << "\n";
+        for (const auto& day : segment.dailyTotals) {
+            out << formatDayNumber(day.first) << ";" << day.second << "\n";
+        }
+        string data = out.str();
+
+        string path = locate(segment, MANIFEST);
+        FILE* file = openFile(path + ".tmp", "wb");
+        bool written = file && fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file);
+        if (file) fclose(file);
+        error_code ec;
+        if (written) filesystem::rename(path + ".tmp", path, ec);
+        if (!written || ec) {
+            throw string("Cannot write manifest of log segment " + to_string(segment.number));
+        }
+        segment.sealed = true;
+        if (empty) segment.firstDay = segment.lastDay = 0;
+    }
+
+    void startSegment() {
+        Segment segment;
+        segment.number = (uint32_t)segments.size() + 1;
+        initDetailLog(locate(segment, DETAILS));
+        segments.push_back(segment);
+    }
+
+    // The single files written before the logs were segmented become
+    // segment 1. The order history index points into them, so it is dropped
+    // and rebuilt; the daily totals already count them as segment 1.
+    // The single files the order log was kept in before segments
+    static string legacyFile(Part part) {
+        static const char* const legacy[] = { "orders.txt", "order_details.bin", "daily_stats.txt" };
+        return legacy[part];
+    }
+
+    static void migrateLegacyFiles() {
+        error_code ec;
+        for (Part part : { ORDERS, DETAILS, STATS }) {
+            if (!filesystem::exists(legacyFile(part), ec)) continue;
+            filesystem::rename(legacyFile(part), "logs/" + fileName(1, part), ec);
+            if (ec) {
+                throw string("Cannot move " + legacyFile(part) + " into logs/");
+            }
+            filesystem::remove("order_index.txt", ec);
+        }
+    }
+
+public:
+    // The `part` file of every segment in order, found without open(), so
+    // nothing is created, migrated or repaired; for tools that only read.
+    // Before the first segment exists that is the legacy file, if any.
+    static vector<string> listFiles(Part part) {
+        vector<string> paths;
+        error_code ec;
+        if (!segmentExists(1)) {
+            if (filesystem::exists(legacyFile(part), ec)) paths.push_back(legacyFile(part));
+            return paths;
+        }
+        for (uint32_t number = 1; segmentExists(number); number++) {
+            for (const char* directory : { "logs/", "logs/archive/" }) {
+                string path = directory + fileName(number, part);
+                if (filesystem::exists(path, ec)) {
+                    paths.push_back(path);
+                    break;
+                }
+            }
+        }
+        return paths;
+    }
+
+    // Finds the segments, reading the manifests of sealed ones and the
+    // files of the hot one only
+    void open() {
+        lock_guard<mutex> lock(logMutex);
+        error_code ec;
+        filesystem::create_directories("logs/archive", ec);
+        if (ec) {
+            throw string("Cannot create the logs directory");
+        }
+
+        segments.clear();
+        if (!segmentExists(1)) {
+            migrateLegacyFiles();
+        }
+        for (uint32_t number = 1; segmentExists(number); number++) {
+            Segment segment;
+            segment.number = number;
+            segment.archived = filesystem::exists("logs/archive/" + fileName(number, MANIFEST), ec);
+
+            // Finish a move to or from the archive that was cut short
+            for (Part part : { ORDERS, DETAILS, STATS }) {
+                string here = locate(segment, part);
+                string there = (segment.archived ? "logs/" : "logs/archive/") + fileName(number, part);
+                if (!filesystem::exists(here, ec) && filesystem::exists(there, ec)) {
+                    filesystem::rename(there, here, ec);
+                }
+            }
+
+            if (!loadManifest(segment)) {
+                Segment rescanned;
+                rescanned.number = number;
+                rescanned.archived = segment.archived;
+                bool hot = !segmentExists(number + 1);
+                scan(rescanned, hot);
+                if (!hot) seal(rescanned); // a crash came between its last batch and its manifest
+                segment = move(rescanned);
+            }
+            segments.push_back(move(segment));
+        }
+        if (segments.empty() || segments.back().sealed) {
+            startSegment();
+        }
+    }
+
+    // Appends a committed batch to the hot segment, sealing it and starting
+    // the next one first when the day has changed or it is full. Only the
+    // order committer appends. A batch that fails part way is cut back out
+    // of all three files, so none of its orders comes back on restart after
+    // the committer has undone them.
+    Appended append(const string& orders, const string& details, const string& stats) {
+        Appended appended;
+        string ordersPath, detailsPath, statsPath;
+        {
+            lock_guard<mutex> lock(logMutex);
+            int today = 0;
+            parseDayNumber(getCurrentDateTime(), today);
+            Segment& hot = segments.back();
+            if (hot.orderCount > 0 && (hot.lastDay < today || hot.bytes >= SEGMENT_BYTES)) {
+                seal(hot);
+                startSegment();
+            }
+            appended.segment = segments.back().number;
+            ordersPath = locate(segments.back(), ORDERS);
+            detailsPath = locate(segments.back(), DETAILS);
+            statsPath = locate(segments.back(), STATS);
+        }
+
+        error_code ec;
+        auto sizeOf = [&ec](const string& path) {
+            uintmax_t size = filesystem::file_size(path, ec);
+            return ec ? (size_t)0 : (size_t)size;
+        };
+        size_t ordersBefore = sizeOf(ordersPath);
+        size_t detailsBefore = sizeOf(detailsPath);
+        size_t statsBefore = sizeOf(statsPath);
+        try {
+            appended.ordersSize = appendAll(ordersPath, orders);
+            appended.detailsSize = appendAll(detailsPath, details);
+            appended.statsSize = appendAll(statsPath, stats);
+        }
+        catch (const string&) {
+            trim(ordersPath, ordersBefore);
+            trim(detailsPath, detailsBefore);
+            trim(statsPath, statsBefore);
+            throw;
+        }
+
+        lock_guard<mutex> lock(logMutex);
+        Segment& hot = segments[appended.segment - 1];
+        RecordReader orderRecords(orders, ordersPath);
+        foldOrders(orderRecords, hot);
+        RecordReader statRecords(stats, statsPath);
+        foldStats(statRecords, hot);
+        hot.bytes = appended.ordersSize + appended.detailsSize + appended.statsSize;
+        return appended;
+    }
+
+    string pathOf(uint32_t number, Part part) const {
+        lock_guard<mutex> lock(logMutex);
+        if (number == 0 || number > segments.size()) {
+            throw string("There is no log segment " + to_string(number));
+        }
+        return locate(segments[number - 1], part);
+    }
+
+    size_t getSegmentCount() const {
+        lock_guard<mutex> lock(logMutex);
+        return segments.size();
+    }
+
+    vector<Segment> getSegments() const {
+        lock_guard<mutex> lock(logMutex);
+        return segments;
+    }
+
+    // Only the segments holding anything dated in [fromDay, toDay)
+    vector<Segment> getSegments(int fromDay, int toDay) const {
+        lock_guard<mutex> lock(logMutex);
+        vector<Segment> found;
+        for (const auto& segment : segments) {
+            if (segment.overlaps(fromDay, toDay)) found.push_back(segment);
+        }
+        return found;
+    }
+
+    long long getLastOrderId() const {
+        lock_guard<mutex> lock(logMutex);
+        long long last = 0;
+        for (const auto& segment : segments) {
+            if (segment.orderCount > 0) last = max(last, segment.lastOrderId);
+        }
+        return last;
+    }
+
+    // Moves the sealed segments that end before `beforeDay` to logs/archive/;
+    // they stay readable from there. Returns how many were moved.
+    size_t archive(int beforeDay) {
+        lock_guard<mutex> lock(logMutex);
+        size_t moved = 0;
+        for (auto& segment : segments) {
+            if (!segment.sealed || segment.archived || segment.lastDay >= beforeDay) continue;
+
+            // The manifest goes last: until it moves, open() moves the rest back
+            vector<Part> done;
+            for (Part part : { ORDERS, DETAILS, STATS, MANIFEST }) {
+                string from = "logs/" + fileName(segment.number, part);
+                error_code ec;
+                if (!filesystem::exists(from, ec)) continue;
+                filesystem::rename(from, "logs/archive/" + fileName(segment.number, part), ec);
+                if (ec) {
+                    for (Part undo : done) {
+                        filesystem::rename("logs/archive/" + fileName(segment.number, undo), "logs/" + fileName(segment.number, undo), ec);
+                    }
+                    throw string("Cannot archive log segment " + to_string(segment.number));
+                }
+                done.push_back(part);
+            }
+            segment.archived = true;
+            moved++;
+        }
+        return moved;
+    }
+};
+#pragma endregion
+
+// Order ids survive restarts: order_id.seq holds the first id nobody has
+// reserved yet, so startup reads one number instead of scanning the order log.
+// Each till hands out ids from its own block of ID_BLOCK and only touches the
+// file to reserve the next block, under order_id.lock so that processes
+// sharing the data files never get the same block. A clean shutdown hands
+// back what is left above the highest id given out, unless another process
+// has reserved a block since; only then, or after a crash, are ids skipped.
+class OrderIdAllocator {
+    static const int ID_BLOCK = 100;
+    static atomic<int> instances;
+
+    struct Block {
+        int owner = 0;
+        int next = 0;
+        int end = 0;
+    };
+
+    const int instance;
+    const SegmentedLog* log;
+    mutex reserveMutex;
+    int reservedEnd;          // what this process last wrote to order_id.seq
+    atomic<int> handedOutEnd; // one past the highest id handed out
+
+    Block& tillBlock() {
+        thread_local Block block;
+        if (block.owner != instance) {
+            block = Block();
+            block.owner = instance;
+        }
+        return block;
+    }
+
+    static bool lockSequence() {
+        for (int attempt = 0; attempt < 500; attempt++) {
+            FILE* lock = openFile("order_id.lock", "wx");
+            if (lock) {
+                fclose(lock);
+                return true;
+            }
+
+            // A lock this old was left behind by a process that crashed
+            error_code ec;
+            auto written = filesystem::last_write_time("order_id.lock", ec);
+            if (!ec && filesystem::file_time_type::clock::now() - written > chrono::seconds(10)) {
+                filesystem::remove("order_id.lock", ec);
+                continue;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    int reserveBlock() {
+        lock_guard<mutex> lock(reserveMutex);
+        if (!lockSequence()) {
+            throw string("Cannot lock order id sequence");
+        }
+
+        int first = 0;
+        ifstream in("order_id.seq");
+        if (!(in >> first)) first = (int)log->getLastOrderId() + 1; // data from before order_id.seq
+        in.close();
+
+        bool written = writeSequence(first + ID_BLOCK);
+        error_code ec;
+        filesystem::remove("order_id.lock", ec);
+
+        if (!written) {
+            throw string("Cannot write order id sequence");
+        }
+        reservedEnd = first + ID_BLOCK;
+        return first;
+    }
+
+    static bool writeSequence(int next) {
+        FILE* file = openFile("order_id.seq.tmp", "wb");
+        bool written = file && fprintf(file, "%d\n", next) > 0 && syncFile(file);
+        if (file) fclose(file);
+        error_code ec;
+        if (written) filesystem::rename("order_id.seq.tmp", "order_id.seq", ec);
+        return written && !ec;
+    }
+public:
+    explicit OrderIdAllocator(const SegmentedLog* log)
+        : instance(++instances), log(log), reservedEnd(0), handedOutEnd(0) {}
+
+    // Called on a clean shutdown, once no more orders are placed
+    void release() {
+        lock_guard<mutex> lock(reserveMutex);
+        int next = handedOutEnd.load();
+        if (reservedEnd == 0 || next >= reservedEnd || !lockSequence()) return;
+
+        int current = 0;
+        ifstream in("order_id.seq");
+        bool unchanged = in >> current && current == reservedEnd;
+        in.close();
+        if (unchanged && writeSequence(next)) reservedEnd = next;
+        error_code ec;
+        filesystem::remove("order_id.lock", ec);
+    }
+
+    int next() {
+        Block& block = tillBlock();
+        if (block.next == block.end) {
+            block.next = reserveBlock();
+            block.end = block.next + ID_BLOCK;
+        }
+        int id = block.next++;
+        int end = handedOutEnd.load();
+        while (end < id + 1 && !handedOutEnd.compare_exchange_weak(end, id + 1)) {
+        }
+        return id;
+    }
+
+    // Returns the id this till took last, for an order that was not placed
+    void giveBack(int id) {
+        Block& block = tillBlock();
+        if (block.next == id + 1) block.next = id;
+        int end = id + 1;
+        handedOutEnd.compare_exchange_strong(end, id);
+    }
+};
+
+atomic<int> OrderIdAllocator::instances(0);
+
+class Order {
+    int orderId;
+    string username;
+    string datetime;
+    vector<pair<MenuItem*, int>> items;
+    vector<pair<string, vector<pair<string, double>>>> itemIngredients;
+    double totalAmount;
+
+public:
+    Order(int orderId, string username)
+        : orderId(orderId), username(username), datetime(getCurrentDateTime()), totalAmount(0) {}
+
+    void addItem(MenuItem* item, int quantity, const vector<pair<string, double>>& modifiedIngredients = {}) {
+        items.push_back({ item, quantity });
+        itemIngredients.push_back({ item->getName(), modifiedIngredients.empty() ?
+                                getOriginalIngredients(item) : modifiedIngredients });
+        totalAmount += item->calculatePrice() * quantity;
+    }
+
+    vector<pair<string, double>> getOriginalIngredients(MenuItem* item) {
+        vector<pair<string, double>> ingredients;
+        for (const auto& pair : item->getIngredients()) {
+            ingredients.push_back({ pair.first->getName(), pair.second });
+        }
+        return ingredients;
+    }
+
+    double getTotalAmount() const { return totalAmount; }
+    int getOrderId() const { return orderId; }
+    string getUsername() const { return username; }
+    const vector<pair<MenuItem*, int>>& getItems() const { return items; }
+    const vector<pair<string, vector<pair<string, double>>>>& getItemIngredients() const { return itemIngredients; }
+
+    string formatRecord() const {
+        ostringstream out;
+        out << orderId << ";"
+            << username << ";"
+            << datetime << ";"
+            << totalAmount << "\n";
+        return out.str();
+    }
+
+    // The order's lines as detail log records
+    string formatDetails(OrderDictionary& dictionary) const {
+        BinaryWriter out;
+        DetailRecord record;
+        record.orderId = (uint32_t)orderId;
+        for (size_t i = 0; i < items.size(); i++) {
+            record.itemId = dictionary.idOf(OrderDictionary::ITEM, items[i].first->getName());
+            record.quantity = (uint32_t)items[i].second;
+            record.price = items[i].first->calculatePrice();
+
+            record.ingredients.clear();
+            for (const auto& ingredient : itemIngredients[i].second) {
+                record.ingredients.push_back({ dictionary.idOf(OrderDictionary::INGREDIENT, ingredient.first), ingredient.second });
+            }
+            record.appendTo(out);
+        }
+        return out.data();
+    }
+};
+
+// Cart lines refer to menu items by the handle Cafe hands out (the MenuItem
+// owned by Cafe), so no cart operation has to match item names again
+class Cart {
+    vector<pair<MenuItem*, int>> items;
+    double total;
+
+    vector<pair<MenuItem*, int>>::iterator findLine(const MenuItem* item) {
+        return find_if(items.begin(), items.end(),
+            [item](const pair<MenuItem*, int>& line) { return line.first == item; });
+    }
+public:
+    Cart() : total(0) {}
+
+    void addItem(MenuItem* item, int quantity) {
+        items.push_back({ item, quantity });
+        recalculateTotal();
+    }
+
+    bool removeItem(const MenuItem* item) {
+        auto it = findLine(item);
+        if (it == items.end()) return false;
+
+        items.erase(it);
+        recalculateTotal();
+        return true;
+    }
+
+    bool modifyItemIngredient(MenuItem* item, const string& ingName, double newQty) {
+        if (findLine(item) == items.end()) return false;
+
+        const auto& ingredients = item->getIngredients();
+        if (ingredients.size() == 1 && newQty == 0) {
+            throw string("Cannot remove the only ingredient from item");
+        }
+
+        bool found = false;
+        for (const auto& ingPair : ingredients) {
+            if (ingPair.first->getName() == ingName) {
+                found = true;
+                if (newQty > ingPair.first->getQuantity()) {
+                    throw string("Insufficient ingredient quantity in inventory");
+                }
+                break;
+            }
+        }
+
+        if (!found) {
+            throw string("Ingredient not found in item");
+        }
+
+        if (!item->updateIngredientQuantity(ingName, newQty)) {
+            throw string(ingName + " comes from a preparation and cannot be changed on its own");
+        }
+        recalculateTotal();
+        return true;
+    }
+
+    void recalculateTotal() {
+        total = 0;
+        for (const auto& pair : items) {
+            total += pair.first->calculatePrice() * pair.second;
+        }
+    }
+
+    double getTotal() const { return total; }
+    const vector<pair<MenuItem*, int>>& getItems() const { return items; }
+
+    int getQuantity(const MenuItem* item) const {
+        int quantity = 0;
+        for (const auto& line : items) {
+            if (line.first == item) quantity += line.second;
+        }
+        return quantity;
+    }
+
+    void clear() {
+        items.clear();
+        total = 0;
+    }
+};
+
+class User {
+    string username;
+    string password;
+    Cart* cart;
+
+public:
+    User(string username, string password)
+        : username(username), password(password) {
+        cart = new Cart();
+    }
+
+    // Orders belong to the Cafe's order pool
+    ~User() {
+        delete cart;
+    }
+
+    static bool validatePassword(const string& pwd) {
+        if (pwd.length() < 6) return false;
+        for (char c : pwd) {
+            if (!isalnum(c)) return false;
+        }
+        return true;
+    }
+
+    bool checkPassword(const string& pwd) const { return password == pwd; }
+    string getUsername() const { return username; }
+    string getPassword() const { return password; }
+    Cart* getCart() { return cart; }
+};
+
+class Admin {
+    string username;
+    string password;
+
+public:
+    Admin(string username, string password) : username(username), password(password) {}
+    bool authenticate(const string& user, const string& pwd) const {
+        return username == user && password == pwd;
+    }
+    ~Admin() {}
+};
+
+// Per-day sales totals kept in daily_rollup.txt so the daily report does not
+// have to reread the sales log. The first line records how far into the log
+// the totals go (#segment;bytes of its stats file); anything past that is
+// folded in on load, and rebuildFromLog() recomputes everything, taking
+// sealed segments from their manifests.
+// Days are kept sorted by day number with running totals, so the revenue of
+// any [from, to) range is two binary searches and a subtraction.
+class SalesRollup {
+    const SegmentedLog* log;
+    vector<int> days;
+    vector<double> amounts;
+    vector<double> prefix; // prefix[i] = sum of amounts[0..i)
+    uint32_t coveredSegment; // segments before it are counted in full
+    long long coveredBytes;
+    mutable mutex rollupMutex;
+
+    void clear() {
+        days.clear();
+        amounts.clear();
+        prefix.assign(1, 0.0);
+        coveredSegment = 1;
+        coveredBytes = 0;
+    }
+
+    void addSale(int day, double amount) {
+        size_t i = lower_bound(days.begin(), days.end(), day) - days.begin();
+        if (i == days.size() || days[i] != day) {
+            // Sales arrive in date order, so this is an append in practice
+            days.insert(days.begin() + i, day);
+            amounts.insert(amounts.begin() + i, 0.0);
+            prefix.insert(prefix.begin() + i + 1, prefix[i]);
+        }
+        amounts[i] += amount;
+        for (size_t j = i + 1; j < prefix.size(); j++) {
+            prefix[j] += amount;
+        }
+    }
+
+    // Folds in what the log holds past the covered position. A sealed
+    // segment that is not covered at all is added from its manifest.
+    void catchUp() {
+        vector<SegmentedLog::Segment> segments = log->getSegments();
+        error_code ec;
+        if (coveredSegment > segments.size() + 1 || (coveredSegment <= segments.size() &&
+            (long long)filesystem::file_size(log->pathOf(coveredSegment, SegmentedLog::STATS), ec) < coveredBytes && !ec)) {
+            clear();
+        }
+
+        for (const auto& segment : segments) {
+            if (segment.number < coveredSegment) continue;
+            if (segment.number > coveredSegment) {
+                coveredSegment = segment.number;
+                coveredBytes = 0;
+            }
+
+            if (segment.sealed && coveredBytes == 0) {
+                for (const auto& day : segment.dailyTotals) {
+                    addSale(day.first, day.second);
+                }
+            }
+            else {
+                RecordReader reader(log->pathOf(segment.number, SegmentedLog::STATS), (size_t)coveredBytes);
+                while (reader.next()) {
+                    if (!reader.isTerminated()) break; // unterminated tail of an interrupted write
+                    coveredBytes = reader.offset();
+                    try {
+                        addRecord(reader);
+                    }
+                    catch (const string& e) {
+                        cerr << e << "\n";
+                    }
+                }
+            }
+
+            if (segment.sealed) {
+                coveredSegment = segment.number + 1;
+                coveredBytes = 0;
+            }
+        }
+    }
+
+    void addRecord(const RecordReader& reader) {
+        int day;
+        if (!parseDayNumber(reader.field(0), day)) {
+            throw reader.error("'" + reader.text(0) + "' is not a date");
+        }
+        addSale(day, reader.number(1));
+    }
+
+    void save() const {
+        ofstream file("daily_rollup.txt.tmp");
+        if (!file.is_open()) {
+            throw string("Cannot open daily rollup file");
+        }
+        file << setprecision(15) << "#" << coveredSegment << ";" << coveredBytes << "\n";
+        for (size_t i = 0; i < days.size(); i++) {
+            file << formatDayNumber(days[i]) << ";" << amounts[i] << "\n";
+        }
+        file.close();
+
+        error_code ec;
+        filesystem::rename("daily_rollup.txt.tmp", "daily_rollup.txt", ec);
+        if (ec) {
+            throw string("Cannot replace daily rollup file");
+        }
+    }
+
+public:
+    explicit SalesRollup(const SegmentedLog* log) : log(log) {
+        clear();
+    }
+
+    void loadFromFile() {
+        lock_guard<mutex> lock(rollupMutex);
+        clear();
+
+        RecordReader reader("daily_rollup.txt");
+        if (reader.next() && reader.field(0).size() > 1 && reader.field(0)[0] == '#') {
+            // "#bytes" is from before segments; those bytes are segment 1
+            string_view header = reader.field(0).substr(1);
+            if (reader.fieldCount() > 1) {
+                from_chars(header.data(), header.data() + header.size(), coveredSegment);
+                header = reader.field(1);
+            }
+            from_chars(header.data(), header.data() + header.size(), coveredBytes);
+            reader.forEach([&]() {
+                addRecord(reader);
+            });
+        }
+
+        uint32_t loadedSegment = coveredSegment;
+        long long loadedBytes = coveredBytes;
+        catchUp();
+        if (coveredSegment != loadedSegment || coveredBytes != loadedBytes) save();
+    }
+
+    void rebuildFromLog() {
+        lock_guard<mutex> lock(rollupMutex);
+        clear();
+        catchUp();
+        save();
+    }
+
+    // Called by the order committer once `records` are durable in the stats
+    // file of `segment` and that file has grown to `logSize` bytes
+    void commit(const string& records, uint32_t segment, long long logSize) {
+        lock_guard<mutex> lock(rollupMutex);
+        // A rebuild running alongside the committer may have read some already
+        size_t skip = 0;
+        long long start = logSize - (long long)records.size();
+        if (segment == coveredSegment && coveredBytes > start) {
+            skip = (size_t)min(coveredBytes - start, (long long)records.size());
+        }
+        RecordReader reader(string_view(records).substr(skip), "daily_stats");
+        reader.forEach([&]() {
+            addRecord(reader);
+        });
+        coveredSegment = segment;
+        coveredBytes = logSize;
+        save();
+    }
+
+    // Revenue of the days in [fromDay, toDay)
+    double getSalesTotal(int fromDay, int toDay) const {
+        lock_guard<mutex> lock(rollupMutex);
+        if (toDay <= fromDay) return 0;
+        size_t from = lower_bound(days.begin(), days.end(), fromDay) - days.begin();
+        size_t to = lower_bound(days.begin(), days.end(), toDay) - days.begin();
+        return prefix[to] - prefix[from];
+    }
+
+    vector<pair<string, double>> getDailySales(int fromDay = INT_MIN, int toDay = INT_MAX) const {
+        lock_guard<mutex> lock(rollupMutex);
+        vector<pair<string, double>> sales;
+        auto it = lower_bound(days.begin(), days.end(), fromDay);
+        for (; it != days.end() && *it < toDay; ++it) {
+            sales.push_back({ formatDayNumber(*it), amounts[it - days.begin()] });
+        }
+        return sales;
+    }
+
+    bool empty() const {
+        lock_guard<mutex> lock(rollupMutex);
+        return days.empty();
+    }
+
+    // First day with sales on or after fromDay, INT_MAX if there is none
+    int getNextSaleDay(int fromDay) const {
+        lock_guard<mutex> lock(rollupMutex);
+        auto it = lower_bound(days.begin(), days.end(), fromDay);
+        return it != days.end() ? *it : INT_MAX;
+    }
+};
+
+// Where each customer's orders sit in the order log, so a page of order
+// history costs a few seeks instead of a scan of every segment.
+// The committer appends to order_index.txt as it writes orders; at startup
+// the index catches up with anything the log gained after it and is
+// rebuilt from scratch when it is missing or points past its end.
+//   username;segment;orderOffset;orderLength;detailsOffset;detailsLength
+class OrderHistoryIndex {
+public:
+    struct Location {
+        uint32_t segment;
+        long long orderOffset;
+        long long orderLength;
+        long long detailsOffset;
+        long long detailsLength;
+    };
+
+    struct PastOrderLine {
+        string itemName;
+        int quantity;
+        double price;
+        vector<pair<string, double>> ingredients;
+    };
+
+    struct PastOrder {
+        long long orderId;
+        string datetime;
+        double total;
+        vector<PastOrderLine> lines;
+    };
+
+private:
+    const SegmentedLog* log;
+    const OrderDictionary* dictionary;
+    unordered_map<string, vector<Location>> byUser;
+    uint32_t coveredSegment;
+    long long coveredOrders;
+    long long coveredDetails;
+    mutable mutex indexMutex;
+
+    void moveTo(uint32_t segment) {
+        coveredSegment = segment;
+        coveredOrders = coveredDetails = 0;
+    }
+
+    void add(const string& username, const Location& at) {
+        byUser[username].push_back(at);
+        if (at.segment > coveredSegment) moveTo(at.segment);
+        if (at.segment == coveredSegment) {
+            coveredOrders = max(coveredOrders, at.orderOffset + at.orderLength);
+            coveredDetails = max(coveredDetails, at.detailsOffset + at.detailsLength);
+        }
+    }
+
+    static string formatEntry(const string& username, const Location& at) {
+        ostringstream out;
+        out << username << ";" << at.segment << ";" << at.orderOffset << ";" << at.orderLength << ";"
+            << at.detailsOffset << ";" << at.detailsLength << "\n";
+        return out.str();
+    }
+
+    string catchUp() {
+        string added;
+        size_t segments = log->getSegmentCount();
+        for (uint32_t segment = coveredSegment; segment <= segments; segment++) {
+            if (segment > coveredSegment) moveTo(segment);
+            added += catchUpSegment();
+        }
+        return added;
+    }
+
+    // Indexes the orders the covered segment holds past the covered offsets.
+    // Orders and their detail lines are written in the same order, so one
+    // cursor walks each file; an order takes the detail lines with its id
+    // until they add up to its total (old logs reuse ids).
+    string catchUpSegment() {
+        RecordReader orders(log->pathOf(coveredSegment, SegmentedLog::ORDERS), (size_t)coveredOrders);
+        DetailRecordReader details(log->pathOf(coveredSegment, SegmentedLog::DETAILS), (size_t)coveredDetails);
+        long long detailStart = (long long)details.offset();
+        bool haveDetail = nextDetail(details);
+        string added;
+
+        while (orders.next() && orders.isTerminated()) {
+            try {
+                long long orderId = orders.integer(0);
+                string username = orders.text(1);
+                double total = orders.number(3);
+
+                Location at = { coveredSegment, coveredOrders, (long long)orders.offset() - coveredOrders, detailStart, 0 };
+                double sum = 0;
+                bool first = true;
+                while (haveDetail) {
+                    const DetailRecord& detail = details.record();
+                    if (detail.orderId != orderId || (!first && sum >= total - 0.005)) break;
+
+                    sum += detail.price * detail.quantity;
+                    first = false;
+                    detailStart = (long long)details.offset();
+                    haveDetail = nextDetail(details);
+                }
+                at.detailsLength = detailStart - at.detailsOffset;
+
+                add(username, at);
+                added += formatEntry(username, at);
+            }
+            catch (const string& e) {
+                cerr << e << "\n";
+            }
+            coveredOrders = orders.offset();
+        }
+        return added;
+    }
+
+    // Steps over records that do not decode; false at the end of the log
+    static bool nextDetail(DetailRecordReader& details) {
+        while (true) {
+            try {
+                return details.next();
+            }
+            catch (const string& e) {
+                cerr << e << "\n";
+            }
+        }
+    }
+
+    static void appendIndex(const string& entries) {
+        if (entries.empty()) return;
+        FILE* file = openFile("order_index.txt", "ab");
+        if (!file) {
+            throw string("Cannot open order index");
+        }
+        bool ok = fwrite(entries.data(), 1, entries.size(), file) == entries.size() && fflush(file) == 0;
+        fclose(file);
+        if (!ok) {
+            throw string("Cannot write order index");
+        }
+    }
+
+    static string readRange(const string& path, long long offset, long long length) {
+        string bytes((size_t)length, '\0');
+        FILE* file = openFile(path, "rb");
+        if (!file) {
+            throw string("Cannot open " + path);
+        }
+        bool ok = seekFile(file, offset) && fread(&bytes[0], 1, bytes.size(), file) == bytes.size();
+        fclose(file);
+        if (!ok) {
+            throw string("Cannot read " + path);
+        }
+        return bytes;
+    }
+
+    PastOrder readOrder(const Location& at) const {
+        PastOrder order;
+        string ordersPath = log->pathOf(at.segment, SegmentedLog::ORDERS);
+        string orderBytes = readRange(ordersPath, at.orderOffset, at.orderLength);
+        RecordReader header(orderBytes, ordersPath);
+        if (!header.next()) {
+            throw string(ordersPath + ": no order at offset " + to_string(at.orderOffset));
+        }
+        order.orderId = header.integer(0);
+        order.datetime = header.text(2);
+        order.total = header.number(3);
+
+        string detailsPath = log->pathOf(at.segment, SegmentedLog::DETAILS);
+        string detailBytes = at.detailsLength > 0 ? readRange(detailsPath, at.detailsOffset, at.detailsLength) : string();
+        DetailRecordReader details(detailBytes, detailsPath);
+        while (nextDetail(details)) {
+            const DetailRecord& detail = details.record();
+            PastOrderLine line;
+            line.itemName = dictionary->nameOf(OrderDictionary::ITEM, detail.itemId);
+            line.quantity = (int)detail.quantity;
+            line.price = detail.price;
+            for (const auto& ingredient : detail.ingredients) {
+                line.ingredients.push_back({ dictionary->nameOf(OrderDictionary::INGREDIENT, ingredient.first), ingredient.second });
+            }
+            order.lines.push_back(move(line));
+        }
+        return order;
+    }
+
+public:
+    OrderHistoryIndex(const SegmentedLog* log, const OrderDictionary* dictionary)
+        : log(log), dictionary(dictionary), coveredSegment(1), coveredOrders(0), coveredDetails(0) {}
+
+    void loadFromFile() {
+        lock_guard<mutex> lock(indexMutex);
+        byUser.clear();
+        moveTo(1);
+
+        size_t validBytes = 0;
+        {
+            RecordReader reader("order_index.txt");
+            while (reader.next() && reader.isTerminated()) {
+                try {
+                    Location at = { (uint32_t)reader.integer(1), reader.integer(2), reader.integer(3),
+                        reader.integer(4), reader.integer(5) };
+                    add(reader.text(0), at);
+                }
+                catch (const string& e) {
+                    cerr << e << "\n";
+                }
+                validBytes = reader.offset();
+            }
+        }
+
+        error_code ec;
+        long long ordersSize = 0, detailsSize = 0;
+        if (coveredSegment <= log->getSegmentCount()) {
+            ordersSize = (long long)filesystem::file_size(log->pathOf(coveredSegment, SegmentedLog::ORDERS), ec);
+            if (ec) ordersSize = 0;
+            detailsSize = (long long)filesystem::file_size(log->pathOf(coveredSegment, SegmentedLog::DETAILS), ec);
+            if (ec) detailsSize = 0;
+        }
+
+        if (coveredOrders > ordersSize || coveredDetails > detailsSize) {
+            // The log was replaced or cut short; index it again
+            byUser.clear();
+            moveTo(1);
+            filesystem::remove("order_index.txt", ec);
+        }
+        else if (filesystem::exists("order_index.txt", ec) && filesystem::file_size("order_index.txt", ec) > validBytes) {
+            // Drop the torn tail of an interrupted append
+            filesystem::resize_file("order_index.txt", validBytes, ec);
+        }
+
+        appendIndex(catchUp());
+    }
+
+    // Called by the order committer once a batch is durable in the logs
+    void commit(const vector<pair<string, Location>>& entries) {
+        lock_guard<mutex> lock(indexMutex);
+        string added;
+        for (const auto& entry : entries) {
+            add(entry.first, entry.second);
+            added += formatEntry(entry.first, entry.second);
+        }
+        appendIndex(added);
+    }
+
+    size_t getOrderCount(const string& username) const {
+        lock_guard<mutex> lock(indexMutex);
+        auto found = byUser.find(username);
+        return found != byUser.end() ? found->second.size() : 0;
+    }
+
+    // Orders `skip` .. `skip + count` counted from the newest
+    vector<PastOrder> getOrders(const string& username, size_t skip, size_t count) const {
+        vector<Location> page;
+        {
+            lock_guard<mutex> lock(indexMutex);
+            auto found = byUser.find(username);
+            if (found == byUser.end()) return {};
+
+            const auto& locations = found->second;
+            for (size_t i = skip; i < locations.size() && page.size() < count; i++) {
+                page.push_back(locations[locations.size() - 1 - i]);
+            }
+        }
+
+        vector<PastOrder> orders;
+        for (const auto& at : page) {
+            orders.push_back(readOrder(at));
+        }
+        return orders;
+    }
+};
+
+// Group commit for completed orders. Tills hand over the formatted records
+// of an order and get a future back; a single writer thread collects
+// everything that arrives within the latency window and appends it with one
+// write + fsync per file, then acknowledges the whole batch.
+class OrderCommitter {
+public:
+    struct Commit {
+        Order* order;
+        string orderRecord;
+        string detailRecords;
+        string statsRecord;
+        double budget;
+        promise<Order*> durable;
+        // Undoes what the till did in memory when the batch fails before its
+        // records are in the order log
+        function<void()> rollback;
+
+        Commit(Order* order, string orderRecord, string detailRecords, string statsRecord, double budget,
+            function<void()> rollback = nullptr)
+            : order(order), orderRecord(move(orderRecord)), detailRecords(move(detailRecords)),
+            statsRecord(move(statsRecord)), budget(budget), durable(), rollback(move(rollback)) {}
+    };
+
+private:
+    Inventory* inventory;
+    SalesRollup* rollup;
+    OrderHistoryIndex* history;
+    OrderDictionary* dictionary;
+    SegmentedLog* log;
+    chrono::milliseconds window;
+    size_t maxBatch;
+
+    deque<Commit> queue;
+    mutex queueMutex;
+    condition_variable queueReady;
+    bool stopping;
+    thread writer;
+
+    static void writeBudget(double budget) {
+        ostringstream out;
+        out << budget << "\n";
+        string data = out.str();
+
+        FILE* file = openFile("budget.txt", "wb");
+        if (!file) {
+            throw string("Cannot open budget file");
+        }
+        bool ok = fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file);
+        fclose(file);
+        if (!ok) {
+            throw string("Cannot write budget file");
+        }
+    }
+
+    void flush(deque<Commit>& batch) {
+        string orders, details, stats;
+        for (const auto& commit : batch) {
+            orders += commit.orderRecord;
+            details += commit.detailRecords;
+            stats += commit.statsRecord;
+        }
+
+        bool logged = false;
+        try {
+            if (!inventory->syncLog()) {
+                throw string("Cannot sync inventory log");
+            }
+            dictionary->sync();
+            SegmentedLog::Appended appended = log->append(orders, details, stats);
+            logged = true;
+            writeBudget(batch.back().budget);
+            if (!stats.empty()) {
+                rollup->commit(stats, appended.segment, appended.statsSize);
+            }
+
+            vector<pair<string, OrderHistoryIndex::Location>> located;
+            long long orderOffset = appended.ordersSize - (long long)orders.size();
+            long long detailsOffset = appended.detailsSize - (long long)details.size();
+            for (const auto& commit : batch) {
+                if (commit.order) {
+                    located.push_back({ commit.order->getUsername(), { appended.segment, orderOffset,
+                        (long long)commit.orderRecord.size(), detailsOffset, (long long)commit.detailRecords.size() } });
+                }
+                orderOffset += commit.orderRecord.size();
+                detailsOffset += commit.detailRecords.size();
+            }
+            if (!located.empty()) {
+                history->commit(located);
+            }
 
-        ofstream detailFile("order_details.txt", ios::app);
-        if (!detailFile.is_open()) {
-            throw string("Cannot open order details file");
+            for (auto& commit : batch) {
+                commit.durable.set_value(commit.order);
+            }
         }
-
-        for (size_t i = 0; i < items.size(); i++) {
-            detailFile << orderId << ";"
-                << items[i].first->getName() << ";"
-                << items[i].second << ";"
-                << items[i].first->calculatePrice() << ";";
-
-            const auto& ingredients = itemIngredients[i].second;
-            for (size_t j = 0; j < ingredients.size(); j++) {
-                detailFile << ingredients[j].first << ":" << ingredients[j].second;
-                if (j < ingredients.size() - 1) detailFile << ",";
+        catch (const string& error) {
+            // Once the records are in the order log a restart brings the
+            // orders back, so only a batch that never got there is undone;
+            // a failed append leaves none of the batch behind
+            for (auto commit = batch.rbegin(); !logged && commit != batch.rend(); ++commit) {
+                if (!commit->rollback) continue;
+                try {
+                    commit->rollback();
+                }
+                catch (const string& rollbackError) {
+                    cerr << rollbackError << "\n";
+                }
+            }
+            for (auto& commit : batch) {
+                commit.durable.set_exception(make_exception_ptr(error));
             }
-            detailFile << "\n";
         }
-
-        file.close();
-        detailFile.close();
     }
-};
 
-int Order::nextOrderId = 0;
-
-class Cart {
-    vector<pair<MenuItem*, int>> items;
-    vector<MenuItem*> modifiedItems;
-    double total;
-public:
-    Cart() : total(0) {}
-    ~Cart() {
-        for (auto* item : modifiedItems) {
-            delete item;
+    void run() {
+        unique_lock<mutex> lock(queueMutex);
+        while (true) {
+            queueReady.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            // Give other tills the rest of the window to join this batch
+            auto deadline = chrono::steady_clock::now() + window;
+            queueReady.wait_until(lock, deadline, [this]() {
+                return stopping || queue.size() >= maxBatch;
+                });
+
+            deque<Commit> batch;
+            batch.swap(queue);
+            lock.unlock();
+            flush(batch);
+            lock.lock();
         }
     }
 
-    void addItem(MenuItem* item, int quantity) {
-        /*MenuItem* modifiedItem = item->createModifiedCopy();*/
-        MenuItem* copy = item;
+public:
+    OrderCommitter(Inventory* inventory, SalesRollup* rollup, OrderHistoryIndex* history, OrderDictionary* dictionary,
+        SegmentedLog* log, chrono::milliseconds window, size_t maxBatch = 256)
+        : inventory(inventory), rollup(rollup), history(history), dictionary(dictionary), log(log),
+        window(window), maxBatch(maxBatch), stopping(false) {
+        writer = thread(&OrderCommitter::run, this);
+    }
 
-        modifiedItems.push_back(copy);
-        items.push_back({ copy, quantity });
-        recalculateTotal();
+    ~OrderCommitter() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_one();
+        writer.join();
     }
 
-    void removeItem(const string& itemName) {
-        for (auto it = items.begin(); it != items.end(); ++it) {
-            if (it->first->getName() == itemName) {
-                for (auto modIt = modifiedItems.begin(); modIt != modifiedItems.end(); ++modIt) {
-                    if ((*modIt)->getName() == itemName) {
-                        delete* modIt;
-                        modifiedItems.erase(modIt);
-                        break;
-                    }
-                }
-                items.erase(it);
-                recalculateTotal();
-                return;
-            }
+    // Takes `amount` off the budget snapshots still waiting in the queue, for
+    // an order rolled back after they were taken. The caller holds the
+    // budget lock, so no snapshot is taken while this runs.
+    void discount(double amount) {
+        lock_guard<mutex> lock(queueMutex);
+        for (auto& commit : queue) {
+            commit.budget -= amount;
         }
     }
 
-    bool modifyItemIngredient(const string& itemName, const string& ingName, double newQty) {
-        for (auto& pair : items) {
-            if (pair.first->getName() == itemName) {
-                auto ingredients = pair.first->getIngredients();
-                if (ingredients.size() == 1 && newQty == 0) {
-                    throw string("Cannot remove the only ingredient from item");
-                }
+    future<Order*> submit(Commit commit) {
+        future<Order*> durable = commit.durable.get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            queue.push_back(move(commit));
+        }
+        queueReady.notify_one();
+        return durable;
+    }
+};
 
-                bool found = false;
-                for (const auto& ingPair : ingredients) {
-                    if (ingPair.first->getName() == ingName) {
-                        found = true;
-                        if (newQty > ingPair.first->getQuantity()) {
-                            throw string("Insufficient ingredient quantity in inventory");
-                        }
-                        break;
-                    }
-                }
+class Cafe {
+    double budget;
+    Inventory* inventory;
+    // Removed menu items stay in their pool until shutdown; carts of other
+    // tills may still point at them and checkout rejects them
+    ObjectPool<Dish> dishes;
+    ObjectPool<Drink> drinks;
+    ObjectPool<User> userPool;
+    ObjectPool<Order> orders;
+    SegmentedLog orderLog;
+    OrderIdAllocator orderIds;
+    vector<User*> users;
+    vector<MenuItem*> menuItems;
+    unordered_map<string, MenuItem*> menuIndex;
+    ObjectPool<Preparation> preparationPool;
+    vector<Preparation*> preparations;
+    unordered_map<string, Preparation*> preparationIndex;
+    Admin* admin;
+    SalesRollup salesRollup;
+    OrderDictionary orderDictionary;
+    OrderHistoryIndex orderHistory;
+    OrderCommitter* committer;
+    PersistenceQueue persistence;
+
+    // The menu as a RecipeMatrix for repriceMenu, rebuilt when an item was
+    // added or removed (menuRevision) or a recipe changed since
+    RecipeMatrix recipeMatrix;
+    vector<MenuItem*> matrixRows;
+    vector<Ingredient*> matrixColumns;
+    uint64_t matrixMenuRevision;
+    uint64_t matrixRecipeRevision;
+    uint64_t menuRevision;
+    mutex matrixMutex;
+
+    // Tills share one Cafe. The menu (items and their recipes) and the user
+    // list are read-mostly and use reader/writer locks; stock changes are
+    // compare-and-swaps on the ingredients involved. A user's cart and order
+    // history belong to the one session that is logged in as that user.
+    mutable shared_mutex menuMutex;
+    mutable shared_mutex usersMutex;
+    mutable mutex budgetMutex;
+
+    void insertMenuItem(MenuItem* item) {
+        menuItems.push_back(item);
+        menuIndex.emplace(item->getName(), item);
+        menuRevision++;
+    }
 
-                if (!found) {
-                    throw string("Ingredient not found in item");
-                }
+    // Caller holds menuMutex and matrixMutex
+    void buildRecipeMatrix() {
+        size_t entries = 0;
+        for (const auto* item : menuItems) {
+            entries += item->getIngredients().size();
+        }
+        recipeMatrix.clear();
+        recipeMatrix.reserve(menuItems.size(), entries);
+        matrixRows = menuItems;
+        matrixColumns.clear();
 
-                pair.first->updateIngredientQuantity(ingName, newQty);
-                recalculateTotal();
-                return true;
+        unordered_map<const Ingredient*, uint32_t> columnOf;
+        for (const auto* item : menuItems) {
+            recipeMatrix.addRow(item->getBasePrice());
+            for (const auto& pair : item->getIngredients()) {
+                auto column = columnOf.emplace(pair.first, (uint32_t)matrixColumns.size());
+                if (column.second) matrixColumns.push_back(pair.first);
+                recipeMatrix.addEntry(column.first->second, pair.second);
             }
         }
-        return false;
+        matrixMenuRevision = menuRevision;
+        matrixRecipeRevision = MenuItem::getRecipeRevision();
     }
 
-    void recalculateTotal() {
-        total = 0;
-        for (const auto& pair : items) {
-            total += pair.first->calculatePrice() * pair.second;
+    // repriceMenu without the locking; the caller holds menuMutex and the
+    // inventory catalog
+    size_t multiplyRecipeMatrix() {
+        lock_guard<mutex> lock(matrixMutex);
+        if (matrixMenuRevision != menuRevision || matrixRecipeRevision != MenuItem::getRecipeRevision()) {
+            buildRecipeMatrix();
         }
-    }
-
-    double getTotal() const { return total; }
-    const vector<pair<MenuItem*, int>>& getItems() const { return items; }
 
-    void clear() {
-        for (auto* item : modifiedItems) {
-            delete item;
+        vector<double> prices(matrixColumns.size());
+        vector<double> itemPrices(matrixRows.size());
+        for (size_t i = 0; i < matrixColumns.size(); i++) {
+            prices[i] = matrixColumns[i]->getPrice();
         }
-        modifiedItems.clear();
-        items.clear();
-        total = 0;
+        recipeMatrix.multiply(prices.data(), itemPrices.data());
+        for (size_t i = 0; i < matrixRows.size(); i++) {
+            matrixRows[i]->storePrice(itemPrices[i]);
+        }
+        return matrixRows.size();
     }
-};
 
-class User {
-    string username;
-    string password;
-    vector<Order*> orderHistory;
-    Cart* cart;
+    MenuItem* lookupMenuItem(const string& name) const {
+        auto found = menuIndex.find(name);
+        return found != menuIndex.end() ? found->second : nullptr;
+    }
 
-public:
-    User(string username, string password)
-        : username(username), password(password) {
-        cart = new Cart();
+    Preparation* lookupPreparation(const string& name) const {
+        auto found = preparationIndex.find(name);
+        return found != preparationIndex.end() ? found->second : nullptr;
     }
 
-    ~User() {
-        delete cart;
-        for (auto* order : orderHistory) {
-            delete order;
+    // A recipe line names an ingredient or, failing that, a preparation
+    RecipeComponent resolveComponent(const string& name, double quantity) const {
+        if (Ingredient* ing = inventory->findIngredient(name)) {
+            return { ing, nullptr, quantity };
+        }
+        if (Preparation* preparation = lookupPreparation(name)) {
+            return { nullptr, preparation, quantity };
         }
+        throw string("Ingredient or preparation not found!");
     }
 
-    static bool validatePassword(const string& pwd) {
-        if (pwd.length() < 6) return false;
-        for (char c : pwd) {
-            if (!isalnum(c)) return false;
+    static void writeComponents(ostream& out, const vector<RecipeComponent>& components) {
+        for (const auto& component : components) {
+            out << ";" << component.getName() << ";" << component.quantity;
         }
-        return true;
     }
 
-    bool checkPassword(const string& pwd) const { return password == pwd; }
-    string getUsername() const { return username; }
-    string getPassword() const { return password; }
-    Cart* getCart() { return cart; }
-
-    void addToOrderHistory(Order* order) {
-        orderHistory.push_back(order);
+    // The file writers take the list under its lock and leave the disk to
+    // the persistence queue, in lock order, so the newest list lands last
+    void writeMenuFile() {
+        ostringstream file;
+        for (const auto* item : menuItems) {
+            file << item->getName() << ";"
+                << item->getBasePrice() << ";"
+                << item->getType() << "\n";
+        }
+        persistence.submit("menu.txt", file.str());
     }
 
-    const vector<Order*>& getOrderHistory() const {
-        return orderHistory;
+    void writeUsersFile() {
+        ostringstream file;
+        for (const auto* user : users) {
+            file << user->getUsername() << ";" << user->getPassword() << "\n";
+        }
+        persistence.submit("users.txt", file.str());
     }
-};
 
-class Admin {
-    string username;
-    string password;
+    // preparations.txt: name;component;quantity;component;quantity...
+    void writePreparationsFile() {
+        ostringstream file;
+        for (const auto* preparation : preparations) {
+            file << preparation->getName();
+            writeComponents(file, preparation->getComponents());
+            file << "\n";
+        }
+        persistence.submit("preparations.txt", file.str());
+    }
 
-public:
-    Admin(string username, string password) : username(username), password(password) {}
-    bool authenticate(const string& user, const string& pwd) const {
-        return username == user && password == pwd;
+    // cafe.snap layout: "CAFESNAP", version, FNV-1a checksum of the payload,
+    // payload size, then the payload: source stamps, budget, ingredients,
+    // preparations, menu items, users. Recipes are written as they were
+    // entered, each component a kind byte (0 ingredient, 1 preparation), its
+    // number and its quantity; the flat recipes are compiled again on load.
+    static const uint32_t SNAPSHOT_VERSION = 2;
+    static const size_t SNAPSHOT_HEADER = 8 + 4 + 4 + 8;
+
+    // Size and modification time of every text file the snapshot stands in
+    // for. The snapshot is only used while all of them still match, so an
+    // edited or newer text file always wins. They are stamped before the
+    // state is read: a change racing with saveSnapshot then either is in the
+    // snapshot or leaves a file that no longer matches.
+    static void putSourceStamps(BinaryWriter& out) {
+        for (const char* path : { "budget.txt", "inventory.txt", "inventory.txt.new", "inventory.log",
+            "inventory.log.old", "users.txt", "preparations.txt", "menu.txt", "menu_ingredients.txt" }) {
+            error_code ec;
+            uint64_t size = filesystem::file_size(path, ec);
+            bool exists = !ec;
+            auto written = filesystem::last_write_time(path, ec);
+            out.put<uint8_t>(exists);
+            out.put<uint64_t>(exists ? size : 0);
+            out.put<int64_t>(exists && !ec ? (int64_t)written.time_since_epoch().count() : 0);
+        }
     }
-    ~Admin() {}
-};
 
-class Cafe {
-    double budget;
-    Inventory* inventory;
-    vector<User*> users;
-    vector<MenuItem*> menuItems;
-    Admin* admin;
+    bool loadSnapshot() {
+        MappedFile file("cafe.snap");
+        if (file.size() < SNAPSHOT_HEADER) return false;
+
+        BinaryReader header(string_view(file.data(), SNAPSHOT_HEADER));
+        string_view magic = header.getBytes(8);
+        uint32_t version = header.get<uint32_t>();
+        uint32_t checksum = header.get<uint32_t>();
+        uint64_t size = header.get<uint64_t>();
+        if (magic != "CAFESNAP" || version != SNAPSHOT_VERSION || size != file.size() - SNAPSHOT_HEADER) {
+            return false;
+        }
+
+        string_view payload(file.data() + SNAPSHOT_HEADER, (size_t)size);
+        if (fnv1a(payload) != checksum) {
+            cerr << "cafe.snap is damaged, loading the text files instead\n";
+            return false;
+        }
+
+        BinaryReader in(payload);
+        BinaryWriter stamps;
+        putSourceStamps(stamps);
+        if (in.getBytes(stamps.data().size()) != stamps.data()) return false;
+
+        budget = in.get<double>();
+        vector<Ingredient*> byIndex;
+        inventory->loadBinary(in, byIndex);
+
+        {
+            unique_lock<shared_mutex> lock(menuMutex);
+            vector<RecipeComponent> recipe;
+            auto getRecipe = [&]() {
+                recipe.clear();
+                uint32_t recipeSize = in.get<uint32_t>();
+                for (uint32_t j = 0; j < recipeSize; j++) {
+                    bool isPreparation = in.get<uint8_t>() != 0;
+                    uint32_t number = in.get<uint32_t>();
+                    double quantity = in.get<double>();
+                    if (isPreparation && number < preparations.size()) {
+                        recipe.push_back({ nullptr, preparations[number], quantity });
+                    }
+                    else if (!isPreparation && number < byIndex.size()) {
+                        recipe.push_back({ byIndex[number], nullptr, quantity });
+                    }
+                }
+            };
+
+            uint32_t preparationCount = in.get<uint32_t>();
+            preparations.reserve(preparationCount);
+            for (uint32_t i = 0; i < preparationCount; i++) {
+                Preparation* preparation = preparationPool.create(in.getString());
+                preparations.push_back(preparation);
+                preparationIndex.emplace(preparation->getName(), preparation);
+            }
+            for (auto* preparation : preparations) {
+                getRecipe();
+                for (const auto& component : recipe) {
+                    preparation->appendComponent(component);
+                }
+            }
+            Preparation::compileAll(preparations);
+
+            uint32_t itemCount = in.get<uint32_t>();
+            menuItems.reserve(itemCount);
+            menuIndex.reserve(itemCount);
+            for (uint32_t i = 0; i < itemCount; i++) {
+                string name = in.getString();
+                bool isDrink = in.get<uint8_t>() != 0;
+                double basePrice = in.get<double>();
+                MenuItem* item = isDrink ?
+                    static_cast<MenuItem*>(drinks.create(name, basePrice)) :
+                    static_cast<MenuItem*>(dishes.create(name, basePrice));
+                insertMenuItem(item);
+
+                getRecipe();
+                item->setComponents(recipe, false);
+            }
+            auto catalog = inventory->lockCatalog();
+            multiplyRecipeMatrix();
+        }
+
+        unique_lock<shared_mutex> lock(usersMutex);
+        uint32_t userCount = in.get<uint32_t>();
+        users.reserve(userCount);
+        for (uint32_t i = 0; i < userCount; i++) {
+            string username = in.getString();
+            string password = in.getString();
+            users.push_back(userPool.create(username, password));
+        }
+        return true;
+    }
 
 public:
-    Cafe(double initialBudget) : budget(initialBudget) {
+    Cafe(double initialBudget, chrono::milliseconds commitWindow = chrono::milliseconds(5))
+        : budget(initialBudget), orderIds(&orderLog), salesRollup(&orderLog), orderHistory(&orderLog, &orderDictionary),
+        matrixMenuRevision(0), matrixRecipeRevision(0), menuRevision(1) {
         admin = new Admin("admin", "admin123");
-        inventory = new Inventory();
+        inventory = new Inventory(&persistence);
+        committer = new OrderCommitter(inventory, &salesRollup, &orderHistory, &orderDictionary, &orderLog, commitWindow);
         loadData();
     }
 
     ~Cafe() {
+        delete committer;
+        orderIds.release();
+        try {
+            // Fold the inventory log first so the snapshot matches the files
+            inventory->saveToFile();
+            saveSnapshot();
+        }
+        catch (const string&) {
+            // the text files and the inventory log are complete on their own
+        }
         delete admin;
         delete inventory;
-        for (auto* user : users) delete user;
-        for (auto* item : menuItems) delete item;
     }
 
     bool updateBudget(double amount) {
-        if (budget + amount < 0) return false;
-        budget += amount;
-        saveBudgetToFile();
+        future<Order*> durable;
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            if (budget + amount < 0) return false;
+            budget += amount;
+            durable = committer->submit({ nullptr, "", "", "", budget });
+        }
+        durable.get();
         return true;
     }
 
@@ -523,6 +4149,7 @@ public:
             throw string("Username is too long");
         }
 
+        unique_lock<shared_mutex> lock(usersMutex);
         for (const auto* user : users) {
             if (user->getUsername() == username) {
                 throw string("Username already exists");
@@ -533,11 +4160,16 @@ public:
             throw string("Invalid password format");
         }
 
-        users.push_back(new User(username, password));
-        saveUsersToFile();
+        users.push_back(userPool.create(username, password));
+        writeUsersFile();
+        lock.unlock();
+
+        // The account is on disk before the new user is told it exists
+        persistence.barrier();
     }
 
     User* login(const string& username, const string& password) {
+        shared_lock<shared_mutex> lock(usersMutex);
         for (auto* user : users) {
             if (user->getUsername() == username && user->checkPassword(password)) {
                 return user;
@@ -551,248 +4183,584 @@ public:
     }
 
     void addMenuItem(const string& name, double basePrice, bool isDrink) {
-        for (const auto* item : menuItems) {
-            if (item->getName() == name) {
-                throw string("Menu item already exists");
-            }
+        unique_lock<shared_mutex> lock(menuMutex);
+        if (menuIndex.count(name)) {
+            throw string("Menu item already exists");
         }
 
         MenuItem* newItem = isDrink ?
-            static_cast<MenuItem*>(new Drink(name, basePrice)) :
-            static_cast<MenuItem*>(new Dish(name, basePrice));
+            static_cast<MenuItem*>(drinks.create(name, basePrice)) :
+            static_cast<MenuItem*>(dishes.create(name, basePrice));
 
-        menuItems.push_back(newItem);
-        saveMenuToFile();
+        insertMenuItem(newItem);
+        writeMenuFile();
     }
 
     void removeMenuItem(const string& name) {
-        for (auto it = menuItems.begin(); it != menuItems.end(); ++it) {
-            if ((*it)->getName() == name) {
-                delete* it;
-                menuItems.erase(it);
-                saveMenuToFile();
-                return;
+        unique_lock<shared_mutex> lock(menuMutex);
+        auto found = menuIndex.find(name);
+        if (found == menuIndex.end()) {
+            throw string("Menu item not found");
+        }
+
+        MenuItem* item = found->second;
+        menuIndex.erase(found);
+        menuItems.erase(find(menuItems.begin(), menuItems.end(), item));
+        item->detach();
+        menuRevision++;
+        writeMenuFile();
+    }
+
+    MenuItem* findMenuItem(const string& name) const {
+        shared_lock<shared_mutex> lock(menuMutex);
+        return lookupMenuItem(name);
+    }
+
+    // Recipe and price edits go through Cafe so they happen under the
+    // menu's writer lock
+    void addMenuItemIngredient(MenuItem* item, Ingredient* ing, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        item->addIngredient(ing, quantity);
+    }
+
+    void addMenuItemPreparation(MenuItem* item, Preparation* preparation, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        item->addPreparation(preparation, quantity);
+    }
+
+    bool updateMenuItemIngredient(MenuItem* item, const string& ingName, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        return item->updateIngredientQuantity(ingName, quantity);
+    }
+
+    Preparation* findPreparation(const string& name) const {
+        shared_lock<shared_mutex> lock(menuMutex);
+        return lookupPreparation(name);
+    }
+
+    void addPreparation(const string& name) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        if (lookupPreparation(name) || inventory->findIngredient(name)) {
+            throw string("An ingredient or preparation with that name already exists");
+        }
+        Preparation* preparation = preparationPool.create(name);
+        preparations.push_back(preparation);
+        preparationIndex.emplace(name, preparation);
+        writePreparationsFile();
+    }
+
+    // Changes to a preparation recompile the flat recipe of every
+    // preparation and menu item built on it
+    void addPreparationComponent(Preparation* preparation, const string& name, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        preparation->addComponent(resolveComponent(name, quantity));
+        writePreparationsFile();
+    }
+
+    bool updatePreparationComponent(Preparation* preparation, const string& name, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        if (!preparation->updateComponentQuantity(name, quantity)) return false;
+        writePreparationsFile();
+        return true;
+    }
+
+    void setMenuItemBasePrice(MenuItem* item, double price) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        item->setBasePrice(price);
+    }
+
+    // Cart totals read the recipes, so cart changes take the menu lock too
+    // Turns items the stock cannot make away from the cart right away;
+    // checkout still takes the stock itself, since another till may get
+    // to it first
+    void addToCart(User* user, MenuItem* item, int quantity) {
+        shared_lock<shared_mutex> lock(menuMutex);
+        Cart* cart = user->getCart();
+        int portions = item->getPortionsAvailable();
+        if (portions < cart->getQuantity(item) + quantity) {
+            if (portions == 0) {
+                throw string(item->getName() + " is sold out");
             }
+            throw string("Only " + to_string(portions) + " portions of " + item->getName() + " are available");
         }
-        throw string("Menu item not found");
+        cart->addItem(item, quantity);
+    }
+
+    bool removeFromCart(User* user, MenuItem* item) {
+        shared_lock<shared_mutex> lock(menuMutex);
+        return user->getCart()->removeItem(item);
     }
 
-    MenuItem* findMenuItem(const string& name) {
-        for (auto* item : menuItems) {
-            if (item->getName() == name) {
-                return item;
+    bool modifyCartItem(User* user, MenuItem* item, const string& ingName, double quantity) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        return user->getCart()->modifyItemIngredient(item, ingName, quantity);
+    }
+
+    // Where an ingredient is used, with the quantity per portion or per
+    // unit of preparation, nested preparations included
+    struct IngredientUses {
+        vector<pair<MenuItem*, double>> items;
+        vector<pair<Preparation*, double>> preparations;
+
+        bool empty() const { return items.empty() && preparations.empty(); }
+    };
+
+    // Reads the ingredient's reverse index, so it costs one step per item
+    // and preparation that uses it. Caller holds menuMutex.
+    IngredientUses usesOf(const Ingredient* ing) const {
+        IngredientUses uses;
+        for (auto* item : *ing->getDependents()) {
+            if (const auto* line = findInFlatRecipe(item->getIngredients(), ing)) {
+                uses.items.push_back({ item, line->second });
             }
         }
-        return nullptr;
+        for (auto* preparation : ing->getPreparationUsers()) {
+            if (const auto* line = findInFlatRecipe(preparation->getFlattened(), ing)) {
+                uses.preparations.push_back({ preparation, line->second });
+            }
+        }
+        return uses;
     }
 
-    Order* processOrder(User* user) {
+    IngredientUses getIngredientUses(const string& name) const {
+        shared_lock<shared_mutex> lock(menuMutex);
+        const Ingredient* ing = inventory->findIngredient(name);
+        if (!ing) {
+            throw string("Ingredient not found");
+        }
+        return usesOf(ing);
+    }
+
+    // Removes an ingredient that no recipe uses. With `cascade` it is first
+    // taken out of every recipe that names it, which recompiles whatever is
+    // built on those; without it the removal is refused and the error
+    // lists the recipes that use it.
+    void removeIngredient(const string& name, bool cascade) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        Ingredient* ing = inventory->findIngredient(name);
+        if (!ing) {
+            throw string("Ingredient not found");
+        }
+
+        IngredientUses uses = usesOf(ing);
+        if (!uses.empty() && !cascade) {
+            string users;
+            for (const auto& use : uses.items) {
+                users += (users.empty() ? "" : ", ") + use.first->getName();
+            }
+            for (const auto& use : uses.preparations) {
+                users += (users.empty() ? "" : ", ") + use.first->getName() + " (preparation)";
+            }
+            throw string(ing->getName() + " is still used by " + users);
+        }
+
+        if (!uses.empty()) {
+            // Preparations first: their users recompile without the
+            // ingredient, and items naming it directly drop it after
+            bool preparationsChanged = false;
+            for (const auto& use : uses.preparations) {
+                preparationsChanged |= use.first->removeIngredient(ing);
+            }
+            for (const auto& use : uses.items) {
+                use.first->removeIngredient(ing);
+            }
+            if (preparationsChanged) writePreparationsFile();
+            writeMenuIngredientsFile();
+        }
+        inventory->removeIngredient(ing->getName());
+    }
+
+    // Applies a supplier price list in one transaction (see
+    // Inventory::importPrices) and reports the items on the menu it re-priced
+    PriceImport importPriceList(const string& path) {
+        vector<PriceUpdate> updates = readPriceList(path);
+        double available;
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            available = budget;
+        }
+
+        shared_lock<shared_mutex> menuLock(menuMutex);
+        PriceImport result = inventory->importPrices(updates, available);
+        result.items.erase(remove_if(result.items.begin(), result.items.end(), [this](const PriceImport::ItemChange& change) {
+            return lookupMenuItem(change.item->getName()) != change.item;
+            }), result.items.end());
+        return result;
+    }
+
+    // Recomputes every cached menu price as one recipe matrix x ingredient
+    // price product instead of a recipe walk per item; the loaders price the
+    // menu this way once all recipes are in. Recipes cannot change
+    // under the menu lock, and the inventory catalog is held so no
+    // ingredient price moves between reading the prices and storing the
+    // results. Returns the number of items repriced.
+    size_t repriceMenu() {
+        shared_lock<shared_mutex> menuLock(menuMutex);
+        auto catalog = inventory->lockCatalog();
+        return multiplyRecipeMatrix();
+    }
+
+    // Hold this while walking getMenu() or item recipes from the UI
+    shared_lock<shared_mutex> lockMenuForReading() const {
+        return shared_lock<shared_mutex>(menuMutex);
+    }
+
+    // Applies the cart to stock and budget right away and queues the order
+    // for group commit; the future resolves once it is on disk
+    future<Order*> submitOrder(User* user) {
         Cart* cart = user->getCart();
         if (cart->getItems().empty()) {
             throw string("Cart is empty");
         }
 
+        shared_lock<shared_mutex> menuLock(menuMutex);
         for (const auto& cartItem : cart->getItems()) {
             MenuItem* item = cartItem.first;
-            int itemQty = cartItem.second;
-
-            for (const auto& ingPair : item->getIngredients()) {
-                Ingredient* ing = ingPair.first;
-                double ingQty = ingPair.second;
-                if (ing->getQuantity() < ingQty * itemQty) {
-                    throw string("Not enough " + ing->getName() + " in stock");
-                }
+            if (lookupMenuItem(item->getName()) != item) {
+                cart->removeItem(item);
+                throw string(item->getName() + " is no longer on the menu and was removed from the cart");
             }
         }
 
-        Order* order = new Order(user->getUsername());
+        // Total need per ingredient across all lines
+        vector<pair<Ingredient*, double>> needs;
         for (const auto& cartItem : cart->getItems()) {
-            MenuItem* item = cartItem.first;
-            int qty = cartItem.second;
-
-            vector<pair<string, double>> modifiedIngredients;
-            for (const auto& ingPair : item->getIngredients()) {
-                modifiedIngredients.push_back({ ingPair.first->getName(), ingPair.second });
-                ingPair.first->decreaseQuantity(ingPair.second * qty);
+            for (const auto& ingPair : cartItem.first->getIngredients()) {
+                needs.push_back({ ingPair.first, ingPair.second * cartItem.second });
+            }
+        }
+        sort(needs.begin(), needs.end(),
+            [](const pair<Ingredient*, double>& a, const pair<Ingredient*, double>& b) { return a.first < b.first; });
+        size_t merged = 0;
+        for (size_t i = 0; i < needs.size(); i++) {
+            if (merged > 0 && needs[merged - 1].first == needs[i].first) {
+                needs[merged - 1].second += needs[i].second;
+            }
+            else {
+                needs[merged++] = needs[i];
             }
+        }
+        needs.resize(merged);
 
-            order->addItem(item, qty, modifiedIngredients);
+        int orderId = orderIds.next();
+        Ingredient* shortage = inventory->reserveStock(needs);
+        if (shortage) {
+            orderIds.giveBack(orderId);
+            throw string("Not enough " + shortage->getName() + " in stock");
         }
 
-        updateBudget(order->getTotalAmount());
-        order->saveToFile();
-        user->addToOrderHistory(order);
-        saveStatistics(order);
+        // Until the order is queued, anything that fails hands the stock back
+        Order* order;
+        string orderRecord, detailRecords, statsRecord;
+        try {
+            order = orders.create(orderId, user->getUsername());
+            for (const auto& cartItem : cart->getItems()) {
+                MenuItem* item = cartItem.first;
+                int qty = cartItem.second;
+
+                vector<pair<string, double>> modifiedIngredients;
+                for (const auto& ingPair : item->getIngredients()) {
+                    modifiedIngredients.push_back({ ingPair.first->getName(), ingPair.second });
+                }
+
+                order->addItem(item, qty, modifiedIngredients);
+            }
+            menuLock.unlock();
+
+            inventory->commitLog(false);
+            orderRecord = order->formatRecord();
+            detailRecords = order->formatDetails(orderDictionary);
+            statsRecord = formatStatistics(order);
+        }
+        catch (...) {
+            // The opposite deltas stay pending until the next commitLog
+            inventory->releaseStock(needs);
+            orderIds.giveBack(orderId);
+            throw;
+        }
         cart->clear();
-        inventory->saveToFile();
 
-        return order;
+        double total = order->getTotalAmount();
+        auto rollback = [this, needs, total]() {
+            inventory->releaseStock(needs);
+            {
+                lock_guard<mutex> budgetLock(budgetMutex);
+                budget -= total;
+                committer->discount(total);
+            }
+            inventory->commitLog();
+        };
+
+        // Submitting under the budget lock keeps the budget snapshots in the
+        // commit queue in the order they were taken
+        lock_guard<mutex> budgetLock(budgetMutex);
+        budget += total;
+        return committer->submit(OrderCommitter::Commit(order, move(orderRecord), move(detailRecords),
+            move(statsRecord), budget, rollback));
+    }
+
+    Order* processOrder(User* user) {
+        return submitOrder(user).get();
     }
 
+    // Takes cafe.snap when it is current and the text files otherwise
     void loadData() {
-        loadBudgetFromFile();
-        inventory->loadFromFile();
-        loadUsersFromFile();
-        loadMenuFromFile();
+        if (!loadSnapshot()) {
+            loadBudgetFromFile();
+            inventory->loadFromFile();
+            loadUsersFromFile();
+            loadPreparationsFromFile();
+            loadMenuFromFile();
+        }
+
+        inventory->loadForecast();
+        orderDictionary.loadFromFile();
+        error_code ec;
+        if (filesystem::exists("order_details.txt", ec) && !filesystem::exists("order_details.bin", ec) &&
+            !filesystem::exists("logs", ec)) {
+            convertDetailLog(orderDictionary);
+        }
+        orderLog.open();
+        salesRollup.loadFromFile();
+        orderHistory.loadFromFile();
+    }
+
+    // Writes budget, inventory, menu with recipes and users to cafe.snap for
+    // a fast next start. The text files stay the import/export format.
+    void saveSnapshot() {
+        // Queued text file writes first, so the stamps see the files as saved
+        persistence.barrier();
+
+        BinaryWriter payload;
+        putSourceStamps(payload);
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            payload.put<double>(budget);
+        }
+
+        unordered_map<const Ingredient*, uint32_t> indexOf;
+        inventory->saveBinary(payload, indexOf);
+        {
+            shared_lock<shared_mutex> lock(menuMutex);
+            unordered_map<const Preparation*, uint32_t> preparationIndexOf;
+            for (uint32_t i = 0; i < preparations.size(); i++) {
+                preparationIndexOf[preparations[i]] = i;
+            }
+            auto putRecipe = [&](const vector<RecipeComponent>& components) {
+                // Removed ingredients are dropped, as the text files do
+                vector<const RecipeComponent*> recipe;
+                for (const auto& component : components) {
+                    if (component.preparation || indexOf.count(component.ingredient)) {
+                        recipe.push_back(&component);
+                    }
+                }
+                payload.put<uint32_t>((uint32_t)recipe.size());
+                for (const auto* component : recipe) {
+                    payload.put<uint8_t>(component->preparation != nullptr);
+                    payload.put<uint32_t>(component->preparation ?
+                        preparationIndexOf.at(component->preparation) : indexOf.at(component->ingredient));
+                    payload.put<double>(component->quantity);
+                }
+            };
+
+            payload.put<uint32_t>((uint32_t)preparations.size());
+            for (const auto* preparation : preparations) {
+                payload.putString(preparation->getName());
+            }
+            for (const auto* preparation : preparations) {
+                putRecipe(preparation->getComponents());
+            }
+
+            payload.put<uint32_t>((uint32_t)menuItems.size());
+            for (const auto* item : menuItems) {
+                payload.putString(item->getName());
+                payload.put<uint8_t>(item->getType() == "Drink");
+                payload.put<double>(item->getBasePrice());
+                putRecipe(item->getComponents());
+            }
+        }
+        {
+            shared_lock<shared_mutex> lock(usersMutex);
+            payload.put<uint32_t>((uint32_t)users.size());
+            for (const auto* user : users) {
+                payload.putString(user->getUsername());
+                payload.putString(user->getPassword());
+            }
+        }
+
+        BinaryWriter header;
+        header.putBytes("CAFESNAP");
+        header.put<uint32_t>(SNAPSHOT_VERSION);
+        header.put<uint32_t>(fnv1a(payload.data()));
+        header.put<uint64_t>(payload.data().size());
+        header.putBytes(payload.data());
+        persistence.submit("cafe.snap", header.data());
+        persistence.barrier();
     }
 
     void loadBudgetFromFile() {
-        ifstream file("budget.txt");
-        if (!file.is_open()) return;
+        RecordReader reader("budget.txt");
+        if (!reader.next()) return;
 
-        string line;
-        getline(file, line);
-        if (!line.empty()) {
-            budget = stod(line);
+        try {
+            budget = reader.number(0);
+        }
+        catch (const string& e) {
+            cerr << e << "\n";
         }
-        file.close();
     }
 
+    // Goes through the committer so it is ordered with the budget
+    // snapshots that order batches write
     void saveBudgetToFile() {
-        ofstream file("budget.txt");
-        if (!file.is_open()) {
-            throw string("Cannot open budget file");
+        future<Order*> durable;
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            durable = committer->submit({ nullptr, "", "", "", budget });
         }
-        file << budget << "\n";
-        file.close();
+        durable.get();
     }
 
     void loadUsersFromFile() {
-        ifstream file("users.txt");
-        if (!file.is_open()) return;
-
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string username, password;
-            getline(ss, username, ';');
-            getline(ss, password, ';');
-            users.push_back(new User(username, password));
-        }
-        file.close();
+        RecordReader reader("users.txt");
+        reader.forEach([&]() {
+            users.push_back(userPool.create(reader.text(0), reader.text(1)));
+        });
     }
 
     void saveUsersToFile() {
-        ofstream file("users.txt");
-        if (!file.is_open()) {
-            throw string("Cannot open users file");
-        }
-        for (const auto* user : users) {
-            file << user->getUsername() << ";" << user->getPassword() << "\n";
-        }
-        file.close();
+        shared_lock<shared_mutex> lock(usersMutex);
+        writeUsersFile();
     }
 
     void loadMenuFromFile() {
-        ifstream file("menu.txt");
-        if (!file.is_open()) return;
+        unique_lock<shared_mutex> lock(menuMutex);
+        RecordReader reader("menu.txt");
+        if (!reader.isOpen()) return;
 
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string name, type, priceStr;
+        reader.forEach([&]() {
+            string name = reader.text(0);
+            double basePrice = reader.number(1);
 
-            getline(ss, name, ';');
-            getline(ss, priceStr, ';');
-            getline(ss, type, ';');
-
-            double basePrice = stod(priceStr);
-
-            if (type == "Drink") {
-                menuItems.push_back(new Drink(name, basePrice));
+            if (menuIndex.count(name)) return;
+            if (reader.field(2) == "Drink") {
+                insertMenuItem(drinks.create(name, basePrice));
             }
             else {
-                menuItems.push_back(new Dish(name, basePrice));
+                insertMenuItem(dishes.create(name, basePrice));
             }
-        }
-        file.close();
+        });
 
+        lock.unlock();
         loadMenuIngredients();
     }
 
     void loadMenuIngredients() {
-        ifstream file("menu_ingredients.txt");
-        if (!file.is_open()) return;
-
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string itemName, ingName, qty;
-
-            getline(ss, itemName, ';');
-            MenuItem* item = findMenuItem(itemName);
-            if (!item) continue;
-
-            while (getline(ss, ingName, ';') && getline(ss, qty, ';')) {
+        unique_lock<shared_mutex> lock(menuMutex);
+        RecordReader reader("menu_ingredients.txt");
+        // The maps are keyed by string; reusing these keeps lookups from
+        // allocating per field
+        string itemName, ingName;
+        // An item may be listed on several lines; its recipe is set and
+        // compiled once, after the whole file is read
+        vector<pair<MenuItem*, vector<RecipeComponent>>> recipes;
+        unordered_map<MenuItem*, size_t> recipeOf;
+        reader.forEach([&]() {
+            itemName.assign(reader.field(0));
+            MenuItem* item = lookupMenuItem(itemName);
+            if (!item) return;
+
+            auto found = recipeOf.find(item);
+            if (found == recipeOf.end()) {
+                found = recipeOf.emplace(item, recipes.size()).first;
+                recipes.push_back({ item, item->getComponents() });
+            }
+            vector<RecipeComponent>& recipe = recipes[found->second].second;
+            for (size_t i = 1; i + 1 < reader.fieldCount(); i += 2) {
+                ingName.assign(reader.field(i));
                 Ingredient* ing = inventory->findIngredient(ingName);
 
                 if (ing) {
-                    item->addIngredient(ing, stod(qty));
+                    recipe.push_back({ ing, nullptr, reader.number(i + 1) });
+                }
+                else if (Preparation* preparation = lookupPreparation(ingName)) {
+                    recipe.push_back({ nullptr, preparation, reader.number(i + 1) });
                 }
             }
-           /* getline(ss, itemName, ';');
-            getline(ss, ingName, ';');
-            getline(ss, qtyStr, ';');
+        });
 
-            double qty = stod(qtyStr);
+        for (const auto& recipe : recipes) {
+            recipe.first->setComponents(recipe.second, false);
+        }
+        auto catalog = inventory->lockCatalog();
+        multiplyRecipeMatrix();
+    }
 
-            MenuItem* item = findMenuItem(itemName);
-            Ingredient* ing = inventory->findIngredient(ingName);
+    // Reads every name first, since a preparation may use one listed after
+    // it, then compiles them all once
+    void loadPreparationsFromFile() {
+        unique_lock<shared_mutex> lock(menuMutex);
+        RecordReader reader("preparations.txt");
+        vector<vector<pair<string, double>>> recipes;
+        reader.forEach([&]() {
+            string name = reader.text(0);
+            if (preparationIndex.count(name)) return;
+
+            Preparation* preparation = preparationPool.create(name);
+            preparations.push_back(preparation);
+            preparationIndex.emplace(name, preparation);
+            recipes.emplace_back();
+            for (size_t i = 1; i + 1 < reader.fieldCount(); i += 2) {
+                recipes.back().push_back({ reader.text(i), reader.number(i + 1) });
+            }
+        });
 
-            if (item && ing) {
-                item->addIngredient(ing, qty);
-            }*/
+        for (size_t i = 0; i < preparations.size(); i++) {
+            for (const auto& line : recipes[i]) {
+                try {
+                    preparations[i]->appendComponent(resolveComponent(line.first, line.second));
+                }
+                catch (const string& e) {
+                    cerr << "preparations.txt: " << preparations[i]->getName() << ": " << line.first << ": " << e << "\n";
+                }
+            }
         }
-        file.close();
+        Preparation::compileAll(preparations);
     }
 
     void saveMenuToFile() {
-        ofstream file("menu.txt");
-        if (!file.is_open()) {
-            throw string("Cannot open menu file");
-        }
-
-        /*ofstream ingFile("menu_ingredients.txt");
-        if (!ingFile.is_open()) {
-            throw string("Cannot open menu ingredients file");
-        }*/
+        shared_lock<shared_mutex> lock(menuMutex);
+        writeMenuFile();
+    }
 
+    // Rewrites menu_ingredients.txt with one line per item, for changes that
+    // take lines out of recipes. Caller holds menuMutex.
+    void writeMenuIngredientsFile() {
+        ostringstream file;
         for (const auto* item : menuItems) {
-            file << item->getName() << ";"
-                << item->getBasePrice() << ";"
-                << item->getType() << "\n";
-
-            /*for (const auto& pair : item->getIngredients()) {
-                ingFile << item->getName() << ";"
-                    << pair.first->getName() << ";"
-                    << pair.second << "\n";
-            }*/
+            if (item->getComponents().empty()) continue;
+            file << item->getName();
+            writeComponents(file, item->getComponents());
+            file << "\n";
         }
-        file.close();
-        //ingFile.close();
+        persistence.submit("menu_ingredients.txt", file.str());
     }
 
-    void saveMenuItemIngredientsToFile(const string& itemName, const vector<pair<Ingredient*, double>>& ingredients) {
-        ofstream ingFile("menu_ingredients.txt", ios::app);
-        if (!ingFile.is_open()) {
-            throw string("Cannot open menu ingredients file");
-        }
+    void saveMenuItemIngredientsToFile(const string& itemName, const vector<RecipeComponent>& components) {
+        ostringstream ingFile;
+        ingFile << itemName;
+        writeComponents(ingFile, components);
+        ingFile << "\n";
+        persistence.submit("menu_ingredients.txt", ingFile.str(), PersistenceQueue::APPEND);
+    }
 
-        try {
-            ingFile << itemName;
-            for (const auto& pair : ingredients) {
-                Ingredient* ing = pair.first;
-                double qty = pair.second;
+    // Waits until every queued file write is on disk
+    void flushPersistence() {
+        persistence.barrier();
+    }
 
-                ingFile << ";" << ing->getName() << ";" << qty;
-            }
-            ingFile << "\n";
-            ingFile.close();
-        }
-        catch (const string& error) {
-            ingFile.close();
-            throw;
-        }
+    PersistenceQueue::Stats getPersistenceStats() const {
+        return persistence.getStats();
     }
 
     struct DailySale {
@@ -802,92 +4770,151 @@ public:
 
     vector<DailySale> getWeeklySales(const string& startDate) {
         vector<DailySale> sales;
-        ifstream file("daily_stats.txt");
-        if (!file.is_open()) return sales;
+        int start;
+        if (!parseDayNumber(startDate, start)) {
+            throw string("Invalid date, expected YYYY-MM-DD");
+        }
+
+        for (const auto& day : salesRollup.getDailySales(start, start + 7)) {
+            sales.push_back({ day.first, day.second });
+        }
+        return sales;
+    }
+
+    // Revenue for [fromDate, toDate)
+    double getSalesTotal(const string& fromDate, const string& toDate) {
+        int from, to;
+        if (!parseDayNumber(fromDate, from) || !parseDayNumber(toDate, to)) {
+            throw string("Invalid date, expected YYYY-MM-DD");
+        }
+        return salesRollup.getSalesTotal(from, to);
+    }
+
+    struct LoggedOrder {
+        long long orderId;
+        string username;
+        string datetime;
+        double total;
+    };
 
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string date, amountStr;
-            getline(ss, date, ';');
-            getline(ss, amountStr, ';');
+    // Orders dated in [fromDate, toDate). Only the log segments whose
+    // manifests overlap the range are read.
+    vector<LoggedOrder> getOrdersBetween(const string& fromDate, const string& toDate, size_t& segmentsRead) {
+        int from, to;
+        if (!parseDayNumber(fromDate, from) || !parseDayNumber(toDate, to)) {
+            throw string("Invalid date, expected YYYY-MM-DD");
+        }
 
-            if (date >= startDate && date < getNextWeekDate(startDate)) {
-                sales.push_back({ date, stod(amountStr) });
+        vector<LoggedOrder> found;
+        vector<SegmentedLog::Segment> segments = orderLog.getSegments(from, to);
+        for (const auto& segment : segments) {
+            RecordReader reader(orderLog.pathOf(segment.number, SegmentedLog::ORDERS));
+            while (reader.next() && reader.isTerminated()) {
+                try {
+                    int day;
+                    if (!parseDayNumber(reader.field(2), day) || day < from || day >= to) continue;
+                    found.push_back({ reader.integer(0), reader.text(1), reader.text(2), reader.number(3) });
+                }
+                catch (const string& e) {
+                    cerr << e << "\n";
+                }
             }
         }
-        file.close();
-        return sales;
+        segmentsRead = segments.size();
+        return found;
     }
 
-    string getNextWeekDate(const string& date) {
-        tm timeinfo = {};
-        istringstream ss(date);
-        ss >> get_time(&timeinfo, "%Y-%m-%d");
-        timeinfo.tm_mday += 7;
-        mktime(&timeinfo);
-        char buffer[11];
-        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &timeinfo);
-        return string(buffer);
+    // Moves sealed log segments that end before `date` to logs/archive/
+    size_t archiveLogs(const string& date) {
+        int day;
+        if (!parseDayNumber(date, day)) {
+            throw string("Invalid date, expected YYYY-MM-DD");
+        }
+        return orderLog.archive(day);
     }
 
-    void saveStatistics(const Order* order) {
-        ofstream daily("daily_stats.txt", ios::app);
-        if (!daily.is_open()) {
-            throw string("Cannot open daily stats file");
+    string getNextWeekDate(const string& date) {
+        int day;
+        if (!parseDayNumber(date, day)) {
+            throw string("Invalid date, expected YYYY-MM-DD");
         }
+        return formatDayNumber(day + 7);
+    }
+
+    string formatStatistics(const Order* order) {
+        ostringstream daily;
         daily << getCurrentDateTime().substr(0, 10) << ";"
             << order->getTotalAmount() << "\n";
-        daily.close();
+        return daily.str();
     }
 
-    double getBudget() const { return budget; }
+    double getBudget() const {
+        lock_guard<mutex> lock(budgetMutex);
+        return budget;
+    }
     Inventory* getInventory() { return inventory; }
+    SalesRollup& getSalesRollup() { return salesRollup; }
+    SegmentedLog& getOrderLog() { return orderLog; }
+    OrderHistoryIndex& getOrderHistory() { return orderHistory; }
+    // See lockMenuForReading()
     const vector<MenuItem*>& getMenu() const { return menuItems; }
+    const vector<Preparation*>& getPreparations() const { return preparations; }
 };
 
 void showWeeklySales(Cafe& cafe) {
     cout << "\n=== Weekly Sales ===\n";
-    ifstream file("daily_stats.txt");
-    if (!file.is_open()) {
+    const SalesRollup& rollup = cafe.getSalesRollup();
+    if (rollup.empty()) {
         cout << "No sales data available\n";
         return;
     }
 
-    string line;
-    vector<pair<string, double>> allSales;
+    int weekStart = rollup.getNextSaleDay(INT_MIN);
+    while (weekStart != INT_MAX) {
+        for (const auto& sale : rollup.getDailySales(weekStart, weekStart + 7)) {
+            cout << sale.first << ": $" << sale.second << "\n";
+        }
+        cout << "\nTotal for week starting " << formatDayNumber(weekStart) << ": $"
+            << rollup.getSalesTotal(weekStart, weekStart + 7) << "\n\n";
+        weekStart = rollup.getNextSaleDay(weekStart + 7);
+    }
+}
 
-    while (getline(file, line)) {
-        if (line.empty()) continue;
-        stringstream ss(line);
-        string date, amountStr;
+void showSalesForPeriod(Cafe& cafe) {
+    string from, to;
+    cout << "From date (YYYY-MM-DD, inclusive): ";
+    getline(cin, from);
+    cout << "To date (YYYY-MM-DD, exclusive): ";
+    getline(cin, to);
 
-        getline(ss, date, ';');
-        getline(ss, amountStr, ';');
+    cout << "Total from " << from << " to " << to << ": $" << cafe.getSalesTotal(from, to) << "\n";
+}
 
-        allSales.push_back({ date, stod(amountStr) });
+void showOrdersForPeriod(Cafe& cafe) {
+    string from, to;
+    cout << "From date (YYYY-MM-DD, inclusive): ";
+    getline(cin, from);
+    cout << "To date (YYYY-MM-DD, exclusive): ";
+    getline(cin, to);
+
+    size_t segmentsRead = 0;
+    auto orders = cafe.getOrdersBetween(from, to, segmentsRead);
+    cout << "\n=== Orders from " << from << " to " << to << " ===\n";
+    if (orders.empty()) {
+        cout << "No orders in this period\n";
     }
-    file.close();
-
-    if (allSales.empty()) {
-        cout << "No sales data available\n";
-        return;
+    for (const auto& order : orders) {
+        cout << "#" << order.orderId << " - " << order.datetime << " - "
+            << order.username << " - $" << order.total << "\n";
     }
+    cout << "(read " << segmentsRead << " of " << cafe.getOrderLog().getSegmentCount() << " log segments)\n";
+}
 
-    sort(allSales.begin(), allSales.end());
-    string currentWeekStart = allSales[0].first;
-    double weeklyTotal = 0;
-
-    for (const auto& sale : allSales) {
-        if (sale.first >= cafe.getNextWeekDate(currentWeekStart)) {
-            cout << "\nTotal for week starting " << currentWeekStart << ": $" << weeklyTotal << "\n\n";
-            currentWeekStart = sale.first;
-            weeklyTotal = 0;
-        }
-        cout << sale.first << ": $" << sale.second << "\n";
-        weeklyTotal += sale.second;
-    }
-    cout << "\nTotal for week starting " << currentWeekStart << ": $" << weeklyTotal << "\n";
+void archiveOldLogs(Cafe& cafe) {
+    string date;
+    cout << "Archive log segments that end before (YYYY-MM-DD): ";
+    getline(cin, date);
+    cout << "Moved " << cafe.archiveLogs(date) << " log segments to logs/archive/\n";
 }
 
 void menuManagementMenu(Cafe& cafe) {
@@ -898,6 +4925,9 @@ void menuManagementMenu(Cafe& cafe) {
             << "2. Remove Menu Item\n"
             << "3. Update Menu Item\n"
             << "4. View Menu\n"
+            << "5. Add Preparation\n"
+            << "6. Update Preparation\n"
+            << "7. View Preparations\n"
             << "0. Back\n"
             << "Choice: ";
 
@@ -929,7 +4959,7 @@ void menuManagementMenu(Cafe& cafe) {
                     double qty;
 
                     cout << "Add ingredient:\n";
-                    cout << "Ingredient name: ";
+                    cout << "Ingredient or preparation name: ";
                     getline(cin, ingName);
                     cout << "Quantity needed: ";
                     cin >> qty;
@@ -937,12 +4967,21 @@ void menuManagementMenu(Cafe& cafe) {
                     cin.ignore(numeric_limits<streamsize>::max(), '\n');
 
                     Ingredient* ing = cafe.getInventory()->findIngredient(ingName);
-                    if (!ing) {
-                        throw string("Ingredient not found!");
+                    Preparation* preparation = ing ? nullptr : cafe.findPreparation(ingName);
+                    if (!ing && !preparation) {
+                        throw string("Ingredient or preparation not found!");
                     }
                     
-                    item->addIngredient(ing, qty);
-                    item->showMenuItemIngr();
+                    if (ing) {
+                        cafe.addMenuItemIngredient(item, ing, qty);
+                    }
+                    else {
+                        cafe.addMenuItemPreparation(item, preparation, qty);
+                    }
+                    {
+                        auto menuLock = cafe.lockMenuForReading();
+                        item->showMenuItemIngr();
+                    }
                     
 
                     cout << "Add another ingredient? (y/n): ";
@@ -950,7 +4989,8 @@ void menuManagementMenu(Cafe& cafe) {
                     cin.clear();
                     cin.ignore(numeric_limits<streamsize>::max(), '\n');
                 } while (tolower(addMore) == 'y');
-                cafe.saveMenuItemIngredientsToFile(item->getName(), item->getIngredients());
+                auto menuLock = cafe.lockMenuForReading();
+                cafe.saveMenuItemIngredientsToFile(item->getName(), item->getComponents());
                 break;
             }
 
@@ -987,7 +5027,7 @@ void menuManagementMenu(Cafe& cafe) {
                     cout << "Enter new quantity: ";
                     cin >> qty;
 
-                    if (!item->updateIngredientQuantity(ingName, qty)) {
+                    if (!cafe.updateMenuItemIngredient(item, ingName, qty)) {
                         throw string("Ingredient not found in menu item!");
                     }
                 }
@@ -995,7 +5035,7 @@ void menuManagementMenu(Cafe& cafe) {
                     double newPrice;
                     cout << "Enter new base price: $";
                     cin >> newPrice;
-                    item->setBasePrice(newPrice);
+                    cafe.setMenuItemBasePrice(item, newPrice);
                 }
                 cafe.saveMenuToFile();
                 break;
@@ -1003,16 +5043,118 @@ void menuManagementMenu(Cafe& cafe) {
 
             case 4: {
                 cout << "\n=== Current Menu ===\n";
+                auto menuLock = cafe.lockMenuForReading();
                 for (const auto* item : cafe.getMenu()) {
                     cout << "\n" << item->getType() << ": " << item->getName()
                         << "\nBase Price: $" << item->getBasePrice()
                         << "\nIngredients:\n";
 
-                    for (const auto& pair : item->getIngredients()) {
+                    bool usesPreparation = false;
+                    for (const auto& component : item->getComponents()) {
+                        cout << "- " << component.getName() << ": " << component.quantity;
+                        if (component.ingredient) {
+                            cout << " " << component.ingredient->getUnit() << endl;
+                        }
+                        else {
+                            cout << " (preparation)" << endl;
+                            usesPreparation = true;
+                        }
+                    }
+                    if (usesPreparation) {
+                        cout << "Ingredients in total:\n";
+                        for (const auto& pair : item->getIngredients()) {
+                            cout << "- " << pair.first->getName() << ": " << pair.second
+                                << " " << pair.first->getUnit() << endl;
+                        }
+                    }
+                    cout << "Total Price: $" << item->calculatePrice() << "\n";
+                    if (item->getPortionsAvailable() != INT_MAX) {
+                        cout << "Portions available: " << item->getPortionsAvailable() << "\n";
+                    }
+                }
+                break;
+            }
+
+            case 5: {
+                string name;
+                cout << "Enter preparation name: ";
+                getline(cin, name);
+                cafe.addPreparation(name);
+                Preparation* preparation = cafe.findPreparation(name);
+
+                char addMore;
+                do {
+                    string componentName;
+                    double qty;
+
+                    cout << "Ingredient or preparation name: ";
+                    getline(cin, componentName);
+                    cout << "Quantity per unit of " << name << ": ";
+                    cin >> qty;
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+                    cafe.addPreparationComponent(preparation, componentName, qty);
+
+                    cout << "Add another ingredient? (y/n): ";
+                    cin >> addMore;
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                } while (tolower(addMore) == 'y');
+                break;
+            }
+
+            case 6: {
+                string name;
+                cout << "Enter preparation name to update: ";
+                getline(cin, name);
+
+                Preparation* preparation = cafe.findPreparation(name);
+                if (!preparation) {
+                    throw string("Preparation not found!");
+                }
+
+                int updateChoice;
+                cout << "\n1. Add ingredient\n"
+                    << "2. Update ingredient quantity\n"
+                    << "Choice: ";
+                cin >> updateChoice;
+                cin.clear();
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+                string componentName;
+                double qty;
+                cout << "Ingredient or preparation name: ";
+                getline(cin, componentName);
+                cout << "Quantity per unit of " << preparation->getName() << ": ";
+                cin >> qty;
+
+                if (updateChoice == 1) {
+                    cafe.addPreparationComponent(preparation, componentName, qty);
+                }
+                else if (updateChoice == 2) {
+                    if (!cafe.updatePreparationComponent(preparation, componentName, qty)) {
+                        throw string("Ingredient not found in preparation!");
+                    }
+                }
+                cout << "Preparation updated; recipes using it were recompiled.\n";
+                break;
+            }
+
+            case 7: {
+                cout << "\n=== Preparations ===\n";
+                auto menuLock = cafe.lockMenuForReading();
+                for (const auto* preparation : cafe.getPreparations()) {
+                    cout << "\n" << preparation->getName() << "\nPer unit:\n";
+                    for (const auto& component : preparation->getComponents()) {
+                        cout << "- " << component.getName() << ": " << component.quantity
+                            << (component.preparation ? " (preparation)" : "") << endl;
+                    }
+                    cout << "Ingredients in total:\n";
+                    for (const auto& pair : preparation->getFlattened()) {
                         cout << "- " << pair.first->getName() << ": " << pair.second
                             << " " << pair.first->getUnit() << endl;
                     }
-                    cout << "Total Price: $" << item->calculatePrice() << "\n";
                 }
                 break;
             }
@@ -1036,6 +5178,10 @@ void statisticsMenu(Cafe& cafe) {
         cout << "\n=== Statistics ===\n"
             << "1. Daily Sales\n"
             << "2. Weekly Sales\n"
+            << "3. Rebuild Daily Totals\n"
+            << "4. Sales for Period\n"
+            << "5. Orders for Period\n"
+            << "6. Archive Old Logs\n"
             << "0. Back\n"
             << "Choice: ";
 
@@ -1047,38 +5193,12 @@ void statisticsMenu(Cafe& cafe) {
             switch (choice) {
             case 1: {
                 cout << "\n=== Daily Sales ===\n";
-                ifstream file("daily_stats.txt");
-                if (!file.is_open()) {
+                auto dailySales = cafe.getSalesRollup().getDailySales();
+                if (dailySales.empty()) {
                     cout << "No sales data available\n";
                     break;
                 }
 
-                string line;
-                vector<pair<string, double>> dailySales;
-
-                while (getline(file, line)) {
-                    if (line.empty()) continue;
-                    stringstream ss(line);
-                    string date, amountStr;
-
-                    getline(ss, date, ';');
-                    getline(ss, amountStr, ';');
-
-                    bool found = false;
-                    for (auto& sale : dailySales) {
-                        if (sale.first == date) {
-                            sale.second += stod(amountStr);
-                            found = true;
-                            break;
-                        }
-                    }
-                    if (!found) {
-                        dailySales.push_back({ date, stod(amountStr) });
-                    }
-                }
-                file.close();
-
-                sort(dailySales.begin(), dailySales.end());
                 for (const auto& sale : dailySales) {
                     cout << sale.first << ": $" << sale.second << endl;
                 }
@@ -1088,6 +5208,23 @@ void statisticsMenu(Cafe& cafe) {
                 showWeeklySales(cafe);
                 break;
 
+            case 3:
+                cafe.getSalesRollup().rebuildFromLog();
+                cout << "Daily totals rebuilt from the sales log\n";
+                break;
+
+            case 4:
+                showSalesForPeriod(cafe);
+                break;
+
+            case 5:
+                showOrdersForPeriod(cafe);
+                break;
+
+            case 6:
+                archiveOldLogs(cafe);
+                break;
+
             case 0:
                 break;
 
@@ -1121,8 +5258,10 @@ void userMenu(Cafe& cafe, User* user) {
             switch (choice) {
             case 1: {
                 cout << "\n=== Menu ===\n";
+                auto menuLock = cafe.lockMenuForReading();
                 for (const auto* item : cafe.getMenu()) {
                     cout << "\n" << item->getType() << ": " << item->getName()
+                        << (item->isSoldOut() ? " (SOLD OUT)" : "")
                         << "\nPrice: $" << item->calculatePrice()
                         << "\nIngredients:\n";
                     for (const auto& pair : item->getIngredients()) {
@@ -1147,11 +5286,11 @@ void userMenu(Cafe& cafe, User* user) {
                     throw string("Menu item not found!");
                 }
 
-                if (cafe.getBudget() < cafe.findMenuItem(itemName)->getBasePrice() * quantity) {
+                if (cafe.getBudget() < item->getBasePrice() * quantity) {
                     throw string("Can't add due to budgetary restrictions");
                     //convert to try catch block along with the code below until break
                 }
-                user->getCart()->addItem(item, quantity);
+                cafe.addToCart(user, item, quantity);
                 cout << "Item added to cart!\n";
                 break;
             }
@@ -1159,14 +5298,17 @@ void userMenu(Cafe& cafe, User* user) {
             case 3: {
                 Cart* cart = user->getCart();
                 cout << "\n=== Your Cart ===\n";
-                for (const auto& cartItem : cart->getItems()) {
-                    cout << cartItem.first->getName() << " x" << cartItem.second << "\n";
-                    cout << "Ingredients:\n";
-                    for (const auto& ing : cartItem.first->getIngredients()) {
-                        cout << "- " << ing.first->getName() << ": " << ing.second
-                            << " " << ing.first->getUnit() << endl;
+                {
+                    auto menuLock = cafe.lockMenuForReading();
+                    for (const auto& cartItem : cart->getItems()) {
+                        cout << cartItem.first->getName() << " x" << cartItem.second << "\n";
+                        cout << "Ingredients:\n";
+                        for (const auto& ing : cartItem.first->getIngredients()) {
+                            cout << "- " << ing.first->getName() << ": " << ing.second
+                                << " " << ing.first->getUnit() << endl;
+                        }
+                        cout << "Price: $" << cartItem.first->calculatePrice() * cartItem.second << endl;
                     }
-                    cout << "Price: $" << cartItem.first->calculatePrice() * cartItem.second << endl;
                 }
                 cout << "Total: $" << cart->getTotal() << endl;
 
@@ -1203,34 +5345,59 @@ void userMenu(Cafe& cafe, User* user) {
                 cout << "Enter new quantity: ";
                 cin >> newQty;
 
-                if (cafe.getBudget() < cafe.findMenuItem(itemName)->getBasePrice() * newQty) {
+                MenuItem* item = cafe.findMenuItem(itemName);
+                if (!item) {
+                    throw string("Menu item not found!");
+                }
+
+                if (cafe.getBudget() < item->getBasePrice() * newQty) {
                     throw string("Can't add due to budgetary restrictions");
                     //convert to try catch block along with the code below until break
                 }
-                cart->modifyItemIngredient(itemName, ingName, newQty);
+                if (!cafe.modifyCartItem(user, item, ingName, newQty)) {
+                    throw string("Item is not in your cart!");
+                }
                 cout << "Item modified successfully!\n";
                 break;
             }
 
             case 5: {
-                cout << "\n=== Order History ===\n";
-                for (const auto* order : user->getOrderHistory()) {
-                    cout << "\nOrder #" << order->getOrderId()
-                        << " - Total: $" << order->getTotalAmount() << endl;
-
-                    for (const auto& itemPair : order->getItems()) {
-                        cout << "\n" << itemPair.first->getName()
-                            << " x" << itemPair.second << endl;
-                        cout << "Used ingredients:\n";
-                        for (const auto& ingInfo : order->getItemIngredients()) {
-                            if (ingInfo.first == itemPair.first->getName()) {
-                                for (const auto& ing : ingInfo.second) {
-                                    cout << "- " << ing.first << ": " << ing.second << endl;
-                                }
+                // Pages are read from the order logs through the index,
+                // newest first, only when they are shown
+                const size_t pageSize = 5;
+                OrderHistoryIndex& history = cafe.getOrderHistory();
+                size_t orderCount = history.getOrderCount(user->getUsername());
+                if (orderCount == 0) {
+                    cout << "\nNo orders yet.\n";
+                    break;
+                }
+
+                size_t page = 0;
+                char action;
+                do {
+                    cout << "\n=== Order History (page " << page + 1 << " of "
+                        << (orderCount + pageSize - 1) / pageSize << ") ===\n";
+                    for (const auto& order : history.getOrders(user->getUsername(), page * pageSize, pageSize)) {
+                        cout << "\nOrder #" << order.orderId << " - " << order.datetime
+                            << " - Total: $" << order.total << endl;
+
+                        for (const auto& line : order.lines) {
+                            cout << "\n" << line.itemName << " x" << line.quantity << endl;
+                            cout << "Used ingredients:\n";
+                            for (const auto& ing : line.ingredients) {
+                                cout << "- " << ing.first << ": " << ing.second << endl;
                             }
                         }
                     }
-                }
+
+                    cout << "\nn. Next page  p. Previous page  0. Back\nChoice: ";
+                    action = '0';
+                    cin >> action;
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    if (action == 'n' && (page + 1) * pageSize < orderCount) page++;
+                    else if (action == 'p' && page > 0) page--;
+                } while (action == 'n' || action == 'p');
                 break;
             }
 
@@ -1248,6 +5415,20 @@ void userMenu(Cafe& cafe, User* user) {
     } while (choice != 0);
 }
 
+void showPersistenceStatus(Cafe& cafe) {
+    PersistenceQueue::Stats stats = cafe.getPersistenceStats();
+    cout << "\n=== Persistence Status ===\n"
+        << "Files written: " << stats.written << "\n"
+        << "Writes folded into a queued one: " << stats.coalesced << "\n"
+        << "Failed writes: " << stats.failed << "\n"
+        << "Queue depth: " << stats.depth << " (max " << stats.maxDepth << " of " << PersistenceQueue::CAPACITY << ")\n"
+        << fixed << setprecision(2)
+        << "Latency: mean " << stats.meanLatencyMs << " ms, p99 " << stats.p99LatencyMs
+        << " ms, max " << stats.maxLatencyMs << " ms\n";
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
 void adminMenu(Cafe& cafe) {
     int choice;
     do {
@@ -1256,6 +5437,8 @@ void adminMenu(Cafe& cafe) {
             << "2. Budget Management\n"
             << "3. Menu Management\n"
             << "4. Statistics\n"
+            << "5. Save Snapshot\n"
+            << "6. Persistence Status\n"
             << "0. Logout\n"
             << "Choice: ";
 
@@ -1277,6 +5460,13 @@ void adminMenu(Cafe& cafe) {
             case 4:
                 statisticsMenu(cafe);
                 break;
+            case 5:
+                cafe.saveSnapshot();
+                cout << "Snapshot saved to cafe.snap\n";
+                break;
+            case 6:
+                showPersistenceStatus(cafe);
+                break;
             case 0:
                 cout << "Logging out...\n";
                 break;
@@ -1290,6 +5480,64 @@ void adminMenu(Cafe& cafe) {
     } while (choice != 0);
 }
 
+string formatHoursLeft(double hours) {
+    ostringstream out;
+    out << fixed << setprecision(1);
+    if (hours < 1) out << hours * 60 << " minutes";
+    else if (hours < 48) out << hours << " hours";
+    else out << hours / 24 << " days";
+    return out.str();
+}
+
+void showStockoutForecast(Cafe& cafe) {
+    vector<StockForecast> forecasts = cafe.getInventory()->forecastStockouts();
+    cout << "\n=== Stockout Forecast ===\n"
+        << "(use per hour weighted over about the last " << ConsumptionRate::TIME_CONSTANT_HOURS << " hours)\n";
+    for (const auto& forecast : forecasts) {
+        const Ingredient* ing = forecast.ingredient;
+        cout << ing->getName() << ": " << forecast.quantity << " " << ing->getUnit() << " left, ";
+        if (isinf(forecast.hoursLeft)) {
+            cout << "no recent use\n";
+            continue;
+        }
+        cout << forecast.perHour << " " << ing->getUnit() << "/hour, runs out in "
+            << formatHoursLeft(forecast.hoursLeft) << "\n";
+    }
+}
+
+void showIngredientUses(const string& name, const Cafe::IngredientUses& uses) {
+    cout << "\n" << name << " is used by:\n";
+    for (const auto& use : uses.items) {
+        cout << "- " << use.first->getName() << ": " << use.second << " per portion\n";
+    }
+    for (const auto& use : uses.preparations) {
+        cout << "- " << use.first->getName() << " (preparation): " << use.second << " per unit\n";
+    }
+}
+
+void showPriceImport(const PriceImport& result) {
+    cout << fixed << setprecision(2)
+        << "\n=== Price List Imported ===\n"
+        << "Ingredients updated: " << result.ingredients.size() << "\n"
+        // Checked against the budget like Update Ingredient, not charged to it
+        << "Restocking cost: $" << result.restockCost << " of a $" << result.budget
+        << " budget (would leave $" << result.budget - result.restockCost << ")\n"
+        << "Stock value change: " << (result.stockValueChange < 0 ? "-$" : "+$") << fabs(result.stockValueChange) << "\n"
+        << "Menu items re-priced: " << result.items.size() << "\n";
+    for (const auto& change : result.items) {
+        const MenuItem* item = change.item;
+        cout << "- " << item->getName() << ": $" << change.oldPrice << " -> $" << change.newPrice;
+        // The base price is the markup over the ingredients
+        if (change.oldPrice > 0 && change.newPrice > 0) {
+            cout << setprecision(1) << " (margin " << 100 * item->getBasePrice() / change.oldPrice
+                << "% -> " << 100 * item->getBasePrice() / change.newPrice << "%)" << setprecision(2);
+        }
+        cout << "\n";
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
 void inventoryMenu(Cafe& cafe) {
     int choice;
     do {
@@ -1298,6 +5546,9 @@ void inventoryMenu(Cafe& cafe) {
             << "2. Remove Ingredient\n"
             << "3. Update Ingredient\n"
             << "4. View Inventory\n"
+            << "5. Stockout Forecast\n"
+            << "6. Import Supplier Price List\n"
+            << "7. Where Used\n"
             << "0. Back\n"
             << "Choice: ";
 
@@ -1337,12 +5588,28 @@ void inventoryMenu(Cafe& cafe) {
                 cout << "Ingredient added successfully!\n";
                 break;
 
-            case 2:
+            case 2: {
                 cout << "Enter ingredient name to remove: ";
                 getline(cin, name);
-                cafe.getInventory()->removeIngredient(name);
+                Cafe::IngredientUses uses = cafe.getIngredientUses(name);
+                bool cascade = false;
+                if (!uses.empty()) {
+                    showIngredientUses(name, uses);
+                    char confirm;
+                    cout << "Remove it from these recipes too? (y/n): ";
+                    cin >> confirm;
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    if (tolower(confirm) != 'y') {
+                        cout << "Ingredient kept.\n";
+                        break;
+                    }
+                    cascade = true;
+                }
+                cafe.removeIngredient(name, cascade);
                 cout << "Ingredient removed successfully!\n";
                 break;
+            }
 
             case 3:
                 cout << "Enter ingredient name to update: ";
@@ -1379,6 +5646,29 @@ void inventoryMenu(Cafe& cafe) {
                 }
                 break;
 
+            case 5:
+                showStockoutForecast(cafe);
+                break;
+
+            case 6:
+                cout << "Price list file (CSV: ingredient,price[,quantity]): ";
+                getline(cin, name);
+                showPriceImport(cafe.importPriceList(name));
+                break;
+
+            case 7: {
+                cout << "Enter ingredient name: ";
+                getline(cin, name);
+                Cafe::IngredientUses uses = cafe.getIngredientUses(name);
+                if (uses.empty()) {
+                    cout << "No recipe uses " << name << ".\n";
+                }
+                else {
+                    showIngredientUses(name, uses);
+                }
+                break;
+            }
+
             case 0:
                 break;
 
@@ -1515,12 +5805,211 @@ void mainMenu(Cafe& cafe) {
     } while (choice != 0);
 }
 
-void main() {
-   try {
-        Cafe cafe(10000.0);
+#pragma region Replay
+// Headless driver: runs a script of till operations against Cafe and reports
+// throughput and per-operation latency. One operation per line, fields
+// separated by ';' like the data files, '#' starts a comment:
+//   register;<user>;<password>    login;<user>;<password>    logout
+//   add;<item>;<qty>              remove;<item>
+//   modify;<item>;<ingredient>;<qty>
+//   checkout                      budget;<amount>
+struct ReplayStats {
+    vector<double> latencies; // microseconds
+    int errors = 0;
+};
+
+void runReplayOperation(Cafe& cafe, User*& user, const vector<string>& fields) {
+    const string& op = fields[0];
+    auto field = [&fields](size_t i) -> const string& {
+        if (i >= fields.size()) {
+            throw string("Missing field " + to_string(i) + " for " + fields[0]);
+        }
+        return fields[i];
+    };
+    auto requireUser = [&user]() {
+        if (!user) {
+            throw string("Not logged in");
+        }
+    };
+
+    if (op == "register") {
+        cafe.registerUser(field(1), field(2));
+    }
+    else if (op == "login") {
+        user = cafe.login(field(1), field(2));
+        if (!user) {
+            throw string("Invalid credentials");
+        }
+    }
+    else if (op == "logout") {
+        user = nullptr;
+    }
+    else if (op == "add") {
+        requireUser();
+        MenuItem* item = cafe.findMenuItem(field(1));
+        if (!item) {
+            throw string("Menu item not found: " + field(1));
+        }
+        cafe.addToCart(user, item, stoi(field(2)));
+    }
+    else if (op == "remove") {
+        requireUser();
+        MenuItem* item = cafe.findMenuItem(field(1));
+        if (!item || !cafe.removeFromCart(user, item)) {
+            throw string("Item is not in the cart: " + field(1));
+        }
+    }
+    else if (op == "modify") {
+        requireUser();
+        MenuItem* item = cafe.findMenuItem(field(1));
+        if (!item || !cafe.modifyCartItem(user, item, field(2), stod(field(3)))) {
+            throw string("Item is not in the cart: " + field(1));
+        }
+    }
+    else if (op == "checkout") {
+        requireUser();
+        cafe.processOrder(user);
+    }
+    else if (op == "budget") {
+        if (!cafe.updateBudget(stod(field(1)))) {
+            throw string("Insufficient funds");
+        }
+    }
+    else {
+        throw string("Unknown operation " + op);
+    }
+}
+
+int runReplay(Cafe& cafe, const string& path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        throw string("Cannot open replay script " + path);
+    }
+
+    vector<vector<string>> script;
+    vector<int> lineNumbers;
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+
+        stringstream ss(line);
+        vector<string> fields;
+        string field;
+        while (getline(ss, field, ';')) fields.push_back(field);
+        script.push_back(fields);
+        lineNumbers.push_back(lineNumber);
+    }
+    file.close();
+
+    map<string, ReplayStats> stats;
+    User* user = nullptr;
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < script.size(); i++) {
+        ReplayStats& opStats = stats[script[i][0]];
+        auto opStarted = chrono::steady_clock::now();
+        try {
+            runReplayOperation(cafe, user, script[i]);
+        }
+        catch (const string& error) {
+            opStats.errors++;
+            cerr << path << ":" << lineNumbers[i] << ": " << error << "\n";
+        }
+        catch (const exception& error) {
+            opStats.errors++;
+            cerr << path << ":" << lineNumbers[i] << ": " << error.what() << "\n";
+        }
+        opStats.latencies.push_back(
+            chrono::duration<double, micro>(chrono::steady_clock::now() - opStarted).count());
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    cout << "\n=== Replay: " << path << " ===\n"
+        << script.size() << " operations in " << fixed << setprecision(3) << elapsed << " s ("
+        << setprecision(0) << (elapsed > 0 ? script.size() / elapsed : 0) << " ops/s)\n\n"
+        << left << setw(10) << "op" << right << setw(9) << "count" << setw(8) << "errors"
+        << setw(12) << "mean us" << setw(12) << "p50 us" << setw(12) << "p99 us"
+        << setw(12) << "max us" << setw(12) << "ops/s" << "\n";
+
+    int failed = 0;
+    for (auto& entry : stats) {
+        vector<double>& latencies = entry.second.latencies;
+        sort(latencies.begin(), latencies.end());
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        auto percentile = [&latencies](double p) {
+            return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+        };
+
+        cout << left << setw(10) << entry.first << right << setw(9) << latencies.size()
+            << setw(8) << entry.second.errors << setprecision(1)
+            << setw(12) << total / latencies.size() << setw(12) << percentile(0.5)
+            << setw(12) << percentile(0.99) << setw(12) << latencies.back()
+            << setprecision(0) << setw(12) << (total > 0 ? latencies.size() / (total / 1e6) : 0) << "\n";
+        failed += entry.second.errors;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+    return failed == 0 ? 0 : 1;
+}
+#pragma endregion
+
+// bench.cpp compiles this file into the benchmarks, which bring their own
+// main()
+#ifndef CAFE_BENCH
+int main(int argc, char* argv[]) {
+    string replayScript;
+    int commitWindowMs = 5;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--replay" && i + 1 < argc) {
+            replayScript = argv[++i];
+        }
+        else if (arg == "--commit-window" && i + 1 < argc) {
+            commitWindowMs = atoi(argv[++i]);
+        }
+        else if (arg == "--convert-details" || arg == "--dump-details") {
+            try {
+                // Dumping only reads: nothing is migrated or repaired
+                OrderDictionary dictionary;
+                dictionary.loadFromFile(arg == "--convert-details");
+                if (arg == "--convert-details") {
+                    size_t converted = convertDetailLog(dictionary);
+                    cout << "Converted " << converted << " order lines to order_details.bin\n";
+                }
+                else if (i + 1 < argc) {
+                    dumpDetailLog(dictionary, argv[++i], cout);
+                }
+                else {
+                    for (const auto& path : SegmentedLog::listFiles(SegmentedLog::DETAILS)) {
+                        dumpDetailLog(dictionary, path, cout);
+                    }
+                }
+                return 0;
+            }
+            catch (const string& error) {
+                cout << "Error: " << error << endl;
+                return 1;
+            }
+        }
+        else {
+            cout << "Usage: " << argv[0] << " [--replay <script>] [--commit-window <ms>]\n"
+                << "       " << argv[0] << " --convert-details | --dump-details [file]\n";
+            return 1;
+        }
+    }
+
+    try {
+        Cafe cafe(10000.0, chrono::milliseconds(commitWindowMs));
+        if (!replayScript.empty()) {
+            return runReplay(cafe, replayScript);
+        }
         mainMenu(cafe);
     }
     catch (const string& error) {
         cout << "Error: " << error << endl;
+        return 1;
     }
-}
\ No newline at end of file
+    return 0;
+}
+#endif
\ No newline at end of file